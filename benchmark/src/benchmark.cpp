@@ -4,8 +4,11 @@
 
 #include <SDKDDKVer.h>
 
-#include "encoder.hpp"
+#include "buffer-pool.hpp"
+#include "lrc.hpp"
+#include "numa.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <vector>
@@ -80,5 +83,373 @@ int main()
 	size_t megabytes = bytes_encoded / (1024 * 1024);
 	float seconds = std::chrono::duration_cast<std::chrono::duration<float>>(encoding_time).count();
 	std::cout << megabytes << " MiB in " << seconds << " seconds = " << (megabytes / seconds) << " MiB/s in " << passes_completed << " iterations" << std::endl;
+
+	// interleave differently sized encodes in one process, as a storage server would see them
+	static constexpr size_t MIXED_SIZES[] = { 4 * 1024, 64 * 1024, 1024 * 1024, BUFFER_SIZE };
+	static constexpr size_t MIXED_SIZE_COUNT = sizeof(MIXED_SIZES) / sizeof(MIXED_SIZES[0]);
+	std::chrono::nanoseconds mixed_time[MIXED_SIZE_COUNT] = {};
+	size_t mixed_bytes[MIXED_SIZE_COUNT] = {};
+	std::chrono::nanoseconds total_mixed_time{ 0 };
+	std::cout << "starting mixed sizes..." << std::endl;
+	while(total_mixed_time < MEASUREMENT_DURATION)
+	{
+		for(size_t i = 0; i < MIXED_SIZE_COUNT; ++i)
+		{
+			// keep the amount of data per size roughly equal, so that the large encodes don't drown out the small ones
+			for(size_t repeat = 0; repeat < BUFFER_SIZE / MIXED_SIZES[i]; ++repeat)
+			{
+				auto start = std::chrono::high_resolution_clock::now();
+				rs.encode_parity(buffers[current_buffer % NUMBER_OF_BUFFER_SETS].shards.get(), 0, MIXED_SIZES[i]);
+				auto end = std::chrono::high_resolution_clock::now();
+				mixed_time[i] += (end - start);
+				total_mixed_time += (end - start);
+				mixed_bytes[i] += MIXED_SIZES[i] * DATA_COUNT;
+			}
+		}
+	}
+	std::cout << "done" << std::endl;
+	for(size_t i = 0; i < MIXED_SIZE_COUNT; ++i)
+	{
+		float mixed_megabytes = static_cast<float>(mixed_bytes[i]) / (1024 * 1024);
+		float mixed_seconds = std::chrono::duration_cast<std::chrono::duration<float>>(mixed_time[i]).count();
+		std::cout << (MIXED_SIZES[i] / 1024) << " KiB shards: " << (mixed_megabytes / mixed_seconds) << " MiB/s" << std::endl;
+	}
+
+	// many small independent objects, encoded one call at a time and then as a single batch
+	static constexpr size_t SMALL_OBJECT_SIZE = 16 * 1024;
+	static constexpr size_t SMALL_OBJECT_COUNT = 1024;
+	encoder e{ DATA_COUNT, PARITY_COUNT };
+	std::vector<encoder::buffer> objects;
+	for(size_t i = 0; i < SMALL_OBJECT_COUNT; ++i)
+	{
+		objects.push_back(e.allocate_buffers_from_object_size(SMALL_OBJECT_SIZE));
+		std::memcpy(objects.back().data.get(), buffers[0].all_shards.get() + (i * SMALL_OBJECT_SIZE), SMALL_OBJECT_SIZE);
+	}
+	size_t individual_objects = 0;
+	std::chrono::nanoseconds individual_time{ 0 };
+	std::cout << "starting individual small objects..." << std::endl;
+	while(individual_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for(encoder::buffer& object : objects)
+		{
+			e.encode(object);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		individual_time += (end - start);
+		individual_objects += SMALL_OBJECT_COUNT;
+	}
+	size_t batched_objects = 0;
+	std::chrono::nanoseconds batched_time{ 0 };
+	std::cout << "starting batched small objects..." << std::endl;
+	while(batched_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		e.encode_batch(objects.data(), objects.size());
+		auto end = std::chrono::high_resolution_clock::now();
+		batched_time += (end - start);
+		batched_objects += SMALL_OBJECT_COUNT;
+	}
+	std::cout << "done" << std::endl;
+	std::cout << (SMALL_OBJECT_SIZE / 1024) << " KiB objects, individually: " << (individual_objects / std::chrono::duration_cast<std::chrono::duration<float>>(individual_time).count()) << " objects/s" << std::endl;
+	std::cout << (SMALL_OBJECT_SIZE / 1024) << " KiB objects, batched: " << (batched_objects / std::chrono::duration_cast<std::chrono::duration<float>>(batched_time).count()) << " objects/s" << std::endl;
+
+	// allocating, filling and encoding each object, with fresh buffers and then with pooled ones
+	buffer_pool pool{ e };
+	const std::pair<const char*, bool> allocators[] = {
+		{ "fresh",  false },
+		{ "pooled", true  },
+	};
+	for(const auto& allocator : allocators)
+	{
+		size_t allocated_objects = 0;
+		std::chrono::nanoseconds allocated_time{ 0 };
+		std::cout << "starting " << allocator.first << " small object allocation..." << std::endl;
+		while(allocated_time < MEASUREMENT_DURATION)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			for(size_t i = 0; i < SMALL_OBJECT_COUNT; ++i)
+			{
+				encoder::buffer object = allocator.second ? pool.allocate_buffers_from_object_size(SMALL_OBJECT_SIZE) : e.allocate_buffers_from_object_size(SMALL_OBJECT_SIZE);
+				std::memcpy(object.data.get(), buffers[0].all_shards.get() + (i * SMALL_OBJECT_SIZE), SMALL_OBJECT_SIZE);
+				e.encode(object);
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			allocated_time += (end - start);
+			allocated_objects += SMALL_OBJECT_COUNT;
+		}
+		std::cout << (SMALL_OBJECT_SIZE / 1024) << " KiB objects, " << allocator.first << " buffers: " << (allocated_objects / std::chrono::duration_cast<std::chrono::duration<float>>(allocated_time).count()) << " objects/s" << std::endl;
+	}
+
+	// 1 MiB objects, copied into shard buffers and then encoded, against encoded where they lie
+	static constexpr size_t IN_PLACE_OBJECT_SIZE = 1024 * 1024;
+	static constexpr size_t IN_PLACE_OBJECT_COUNT = BUFFER_SIZE / IN_PLACE_OBJECT_SIZE;
+	encoder::buffer copied = e.allocate_buffers_from_object_size(IN_PLACE_OBJECT_SIZE);
+	encoder::buffer parity = e.allocate_parity_buffers_from_object_size(IN_PLACE_OBJECT_SIZE);
+	size_t copied_objects = 0;
+	std::chrono::nanoseconds copied_time{ 0 };
+	std::cout << "starting copied objects..." << std::endl;
+	while(copied_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for(size_t i = 0; i < IN_PLACE_OBJECT_COUNT; ++i)
+		{
+			std::memcpy(copied.data.get(), buffers[0].all_shards.get() + (i * IN_PLACE_OBJECT_SIZE), IN_PLACE_OBJECT_SIZE);
+			e.encode(copied);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		copied_time += (end - start);
+		copied_objects += IN_PLACE_OBJECT_COUNT;
+	}
+	size_t in_place_objects = 0;
+	std::chrono::nanoseconds in_place_time{ 0 };
+	std::cout << "starting in-place objects..." << std::endl;
+	while(in_place_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for(size_t i = 0; i < IN_PLACE_OBJECT_COUNT; ++i)
+		{
+			e.encode_object(buffers[0].all_shards.get() + (i * IN_PLACE_OBJECT_SIZE), IN_PLACE_OBJECT_SIZE, parity);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		in_place_time += (end - start);
+		in_place_objects += IN_PLACE_OBJECT_COUNT;
+	}
+	std::cout << "done" << std::endl;
+	std::cout << (IN_PLACE_OBJECT_SIZE / 1024) << " KiB objects, copied: " << (copied_objects / std::chrono::duration_cast<std::chrono::duration<float>>(copied_time).count()) << " objects/s" << std::endl;
+	std::cout << (IN_PLACE_OBJECT_SIZE / 1024) << " KiB objects, in place: " << (in_place_objects / std::chrono::duration_cast<std::chrono::duration<float>>(in_place_time).count()) << " objects/s" << std::endl;
+
+	// rewriting 64 KiB of one data shard of a stripe of 1 MiB shards, re-encoding everything against updating the parity
+	static constexpr size_t REWRITE_SHARD_SIZE = 1024 * 1024;
+	static constexpr size_t REWRITE_SIZE = 64 * 1024;
+	encoder::buffer rewritten = e.allocate_buffers_from_shard_size(REWRITE_SHARD_SIZE);
+	std::memcpy(rewritten.data.get(), buffers[0].all_shards.get(), rewritten.buffer_size);
+	e.encode(rewritten);
+	const std::pair<const char*, bool> rewrite_modes[] = {
+		{ "re-encoded",     false },
+		{ "parity updated", true  },
+	};
+	for(const auto& mode : rewrite_modes)
+	{
+		size_t rewrites = 0;
+		std::chrono::nanoseconds rewrite_time{ 0 };
+		std::cout << "starting " << mode.first << " rewrites..." << std::endl;
+		while(rewrite_time < MEASUREMENT_DURATION)
+		{
+			const uint8_t shard = static_cast<uint8_t>(rewrites % DATA_COUNT);
+			const size_t offset = (rewrites * REWRITE_SIZE) % REWRITE_SHARD_SIZE;
+			const unsigned char* replacement = buffers[0].all_shards.get() + ((rewrites * REWRITE_SIZE) % (BUFFER_SIZE - REWRITE_SIZE));
+			auto start = std::chrono::high_resolution_clock::now();
+			if(mode.second)
+			{
+				e.update(rewritten, shard, offset, replacement, REWRITE_SIZE);
+			}
+			else
+			{
+				std::memcpy(rewritten.shards[shard] + offset, replacement, REWRITE_SIZE);
+				e.encode(rewritten);
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			rewrite_time += (end - start);
+			++rewrites;
+		}
+		std::cout << (REWRITE_SIZE / 1024) << " KiB rewrites, " << mode.first << ": " << (rewrites / std::chrono::duration_cast<std::chrono::duration<float>>(rewrite_time).count()) << " rewrites/s" << std::endl;
+	}
+
+	// encoding and then checksumming every shard in a second pass, against checksumming each chunk as it's encoded
+	uint32_t shard_checksums[TOTAL_COUNT];
+	std::vector<uint32_t> block_checksums(TOTAL_COUNT * ((BUFFER_SIZE + reed_solomon::default_checksum_block_size - 1) / reed_solomon::default_checksum_block_size));
+	const std::pair<const char*, bool> checksum_modes[] = {
+		{ "separate checksum pass", false },
+		{ "fused checksums",        true  },
+	};
+	for(const auto& mode : checksum_modes)
+	{
+		size_t checksummed_bytes = 0;
+		std::chrono::nanoseconds checksummed_time{ 0 };
+		std::cout << "starting " << mode.first << "..." << std::endl;
+		while(checksummed_time < MEASUREMENT_DURATION)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			if(mode.second)
+			{
+				rs.encode_parity_with_checksums(buffers[0].shards.get(), 0, BUFFER_SIZE, shard_checksums, block_checksums.data());
+			}
+			else
+			{
+				rs.encode_parity(buffers[0].shards.get(), 0, BUFFER_SIZE);
+				for(size_t i = 0; i < TOTAL_COUNT; ++i)
+				{
+					shard_checksums[i] = crc32c::compute(0, buffers[0].shards[i], BUFFER_SIZE);
+				}
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			checksummed_time += (end - start);
+			checksummed_bytes += BUFFER_SIZE * DATA_COUNT;
+		}
+		std::cout << (BUFFER_SIZE / (1024 * 1024)) << " MiB shards, " << mode.first << ": " << ((static_cast<float>(checksummed_bytes) / (1024 * 1024)) / std::chrono::duration_cast<std::chrono::duration<float>>(checksummed_time).count()) << " MiB/s" << std::endl;
+	}
+
+	// one bad 4 KiB block in a data shard, rebuilt by decoding the whole shard against decoding just that block
+	std::unique_ptr<bool[]> block_present{ new bool[TOTAL_COUNT] };
+	std::fill(block_present.get(), block_present.get() + TOTAL_COUNT, true);
+	block_present[1] = false;
+	reed_solomon::damage_map damage(TOTAL_COUNT, std::vector<bool>(BUFFER_SIZE / reed_solomon::default_checksum_block_size));
+	damage[1][damage[1].size() / 2] = true;
+	const std::pair<const char*, bool> repair_modes[] = {
+		{ "whole shard",   false },
+		{ "damaged block", true  },
+	};
+	for(const auto& mode : repair_modes)
+	{
+		size_t repairs = 0;
+		std::chrono::nanoseconds repair_time{ 0 };
+		std::cout << "starting " << mode.first << " repairs..." << std::endl;
+		while(repair_time < MEASUREMENT_DURATION)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			if(mode.second)
+			{
+				rs.decode_damaged_blocks(buffers[0].shards.get(), damage, 0, BUFFER_SIZE, reed_solomon::default_checksum_block_size);
+			}
+			else
+			{
+				rs.decode_missing(buffers[0].shards.get(), block_present.get(), 0, BUFFER_SIZE);
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			repair_time += (end - start);
+			++repairs;
+		}
+		std::cout << (BUFFER_SIZE / (1024 * 1024)) << " MiB shards with one bad block, " << mode.first << " repair: " << (repairs / std::chrono::duration_cast<std::chrono::duration<float>>(repair_time).count()) << " repairs/s" << std::endl;
+	}
+
+	// single lost shards, cycling through every shard of the stripe, rebuilt by a 12+2+2 locally repairable code and by 12+4 Reed-Solomon
+	static constexpr size_t LRC_SHARD_SIZE = 1024 * 1024;
+	const lrc lrc_code{ 12, 2, 2 };
+	const reed_solomon rs_code{ 12, 4 };
+	lrc_code.encode_parity(buffers[0].shards.get(), 0, LRC_SHARD_SIZE);
+	std::unique_ptr<bool[]> lrc_present{ new bool[lrc_code.get_shard_count()] };
+	const std::pair<const char*, bool> codes[] = {
+		{ "LRC 12+2+2",        true  },
+		{ "Reed-Solomon 12+4", false },
+	};
+	for(const auto& code : codes)
+	{
+		if(!code.second)
+		{
+			rs_code.encode_parity(buffers[0].shards.get(), 0, LRC_SHARD_SIZE);
+		}
+		size_t single_repairs = 0;
+		size_t shards_read = 0;
+		std::chrono::nanoseconds single_repair_time{ 0 };
+		std::cout << "starting " << code.first << " single shard repairs..." << std::endl;
+		while(single_repair_time < MEASUREMENT_DURATION)
+		{
+			std::fill(lrc_present.get(), lrc_present.get() + lrc_code.get_shard_count(), true);
+			lrc_present[single_repairs % lrc_code.get_shard_count()] = false;
+			auto start = std::chrono::high_resolution_clock::now();
+			if(code.second)
+			{
+				lrc_code.decode_missing(buffers[0].shards.get(), lrc_present.get(), 0, LRC_SHARD_SIZE);
+			}
+			else
+			{
+				rs_code.decode_missing(buffers[0].shards.get(), lrc_present.get(), 0, LRC_SHARD_SIZE);
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			single_repair_time += (end - start);
+			shards_read += code.second ? lrc_code.plan_repair(lrc_present.get()).shards_read() : rs_code.get_data_shard_count();
+			++single_repairs;
+		}
+		std::cout << code.first << " single shard repairs: " << (static_cast<float>(shards_read) / single_repairs) << " shards read per repair, " << (single_repairs / std::chrono::duration_cast<std::chrono::duration<float>>(single_repair_time).count()) << " repairs/s" << std::endl;
+	}
+
+	// per-call latency distribution for small stripes under each execution policy
+	static constexpr size_t LATENCY_SHARD_SIZE = 4 * 1024;
+	static constexpr size_t LATENCY_SAMPLES = 100000;
+	const std::pair<const char*, reed_solomon::execution_policy> policies[] = {
+		{ "parallel", reed_solomon::execution_policy::parallel },
+		{ "serial",   reed_solomon::execution_policy::serial   },
+	};
+	std::vector<std::chrono::nanoseconds> latencies(LATENCY_SAMPLES);
+	for(const auto& policy : policies)
+	{
+		for(size_t i = 0; i < LATENCY_SAMPLES; ++i)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			rs.encode_parity(buffers[0].shards.get(), 0, LATENCY_SHARD_SIZE, policy.second);
+			auto end = std::chrono::high_resolution_clock::now();
+			latencies[i] = end - start;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		auto percentile = [&](double p)
+		{
+			return std::chrono::duration_cast<std::chrono::duration<float, std::micro>>(latencies[static_cast<size_t>(p * (LATENCY_SAMPLES - 1))]).count();
+		};
+		std::cout << (LATENCY_SHARD_SIZE / 1024) << " KiB x " << static_cast<int>(TOTAL_COUNT) << " " << policy.first << ": p50 " << percentile(0.5) << " us, p99 " << percentile(0.99) << " us, p99.9 " << percentile(0.999) << " us" << std::endl;
+	}
+	std::cout << "autotuned serial threshold: " << rs.autotune_serial_threshold() << " bytes" << std::endl;
+
+	// large objects whose pages are placed by the node that encodes them, against ones that land wherever the allocator put them
+	static constexpr size_t NUMA_OBJECT_SIZE = 64 * 1024 * 1024;
+	numa_encoder ne{ DATA_COUNT, PARITY_COUNT };
+	std::cout << "NUMA nodes: " << ne.get_node_count() << std::endl;
+	encoder::buffer unplaced = e.allocate_buffers_from_object_size(NUMA_OBJECT_SIZE);
+	encoder::buffer placed = ne.allocate_buffers_from_object_size(NUMA_OBJECT_SIZE, 0);
+	for(size_t i = 0; i < NUMA_OBJECT_SIZE; i += BUFFER_SIZE)
+	{
+		std::memcpy(unplaced.data.get() + i, buffers[0].all_shards.get(), BUFFER_SIZE);
+		std::memcpy(placed.data.get() + i, buffers[0].all_shards.get(), BUFFER_SIZE);
+	}
+	size_t unplaced_bytes = 0;
+	std::chrono::nanoseconds unplaced_time{ 0 };
+	std::cout << "starting unplaced large objects..." << std::endl;
+	while(unplaced_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		e.encode(unplaced);
+		auto end = std::chrono::high_resolution_clock::now();
+		unplaced_time += (end - start);
+		unplaced_bytes += NUMA_OBJECT_SIZE;
+	}
+	size_t placed_bytes = 0;
+	std::chrono::nanoseconds placed_time{ 0 };
+	std::cout << "starting NUMA-placed large objects..." << std::endl;
+	while(placed_time < MEASUREMENT_DURATION)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		ne.encode(placed);
+		auto end = std::chrono::high_resolution_clock::now();
+		placed_time += (end - start);
+		placed_bytes += NUMA_OBJECT_SIZE;
+	}
+	std::cout << "done" << std::endl;
+	std::cout << (NUMA_OBJECT_SIZE / (1024 * 1024)) << " MiB objects, unplaced: " << ((static_cast<float>(unplaced_bytes) / (1024 * 1024)) / std::chrono::duration_cast<std::chrono::duration<float>>(unplaced_time).count()) << " MiB/s" << std::endl;
+	std::cout << (NUMA_OBJECT_SIZE / (1024 * 1024)) << " MiB objects, NUMA-placed: " << ((static_cast<float>(placed_bytes) / (1024 * 1024)) / std::chrono::duration_cast<std::chrono::duration<float>>(placed_time).count()) << " MiB/s" << std::endl;
+
+	// the same 16 MiB shards as the first test, in encoder buffers allocated each way
+	const std::pair<const char*, bool> allocation_modes[] = {
+		{ "64-byte aligned", false },
+		{ "huge pages",      true  },
+	};
+	for(const auto& mode : allocation_modes)
+	{
+		e.set_huge_pages(mode.second);
+		encoder::buffer shard_set = e.allocate_buffers_from_shard_size(BUFFER_SIZE);
+		std::memcpy(shard_set.data.get(), buffers[0].all_shards.get(), BUFFER_SIZE * TOTAL_COUNT);
+		size_t mode_bytes = 0;
+		std::chrono::nanoseconds mode_time{ 0 };
+		std::cout << "starting " << mode.first << " allocation..." << std::endl;
+		while(mode_time < MEASUREMENT_DURATION)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			e.encode(shard_set);
+			auto end = std::chrono::high_resolution_clock::now();
+			mode_time += (end - start);
+			mode_bytes += BUFFER_SIZE * DATA_COUNT;
+		}
+		std::cout << mode.first << " allocation: " << ((static_cast<float>(mode_bytes) / (1024 * 1024)) / std::chrono::duration_cast<std::chrono::duration<float>>(mode_time).count()) << " MiB/s" << std::endl;
+	}
+	e.set_huge_pages(false);
 }
 
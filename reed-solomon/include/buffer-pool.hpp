@@ -0,0 +1,159 @@
+// reusable buffers. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+// hands out encoder buffers whose memory is recycled rather than freed, so that a steady stream of objects doesn't pay for a
+// fresh allocation, its page faults and a full memset every time. Memory is kept in size classes a quarter of a power of two
+// apart, so buffers of similar sizes share it. Destroying a buffer returns its memory to the pool, which must outlive it.
+// Safe to use from many threads at once.
+struct buffer_pool : encoder::memory_source
+{
+	static constexpr size_t default_max_retained_bytes = 1024 * 1024 * 1024;
+
+	// memory beyond max_retained_bytes that comes back to the pool is freed instead of kept.
+	buffer_pool(const encoder& e_, size_t max_retained_bytes_ = default_max_retained_bytes, bool huge_pages_ = false) : e(e_),
+	                                                                                                                   max_retained_bytes(max_retained_bytes_),
+	                                                                                                                   huge_pages(huge_pages_),
+	                                                                                                                   retained_bytes(0)
+	{
+	}
+
+	~buffer_pool()
+	{
+		trim();
+	}
+
+	buffer_pool(const buffer_pool&) = delete;
+	buffer_pool& operator=(const buffer_pool&) = delete;
+
+	// only the padding, and the part of the data shards past the end of the object, are zeroed. The object's bytes are about
+	// to be copied in, and encoding overwrites the parity shards.
+	encoder::buffer allocate_buffers_from_object_size(const size_t object_size)
+	{
+		return object_buffers(object_size, 0);
+	}
+
+	encoder::buffer allocate_buffers_from_object_size(const size_t object_size, const size_t minimum_padding)
+	{
+		return object_buffers(object_size, encoder::padding_size_for(minimum_padding));
+	}
+
+	// nothing is zeroed; the caller is expected to fill every shard, as when reading them back from storage.
+	encoder::buffer allocate_buffers_from_shard_size(const size_t shard_size)
+	{
+		return encoder::buffer{ take(shard_size * e.get_shard_count()), shard_size, e.get_shard_count(), 0 };
+	}
+
+	encoder::buffer allocate_buffers_from_shard_size(const size_t shard_size, const size_t minimum_padding)
+	{
+		return encoder::buffer{ take(shard_size * e.get_shard_count()), shard_size, e.get_shard_count(), encoder::padding_size_for(minimum_padding) };
+	}
+
+	size_t get_retained_bytes() const
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex);
+		return retained_bytes;
+	}
+
+	// frees all of the memory the pool is holding on to. Buffers that are still out are unaffected.
+	void trim()
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex);
+		for(auto& size_class : free_blocks)
+		{
+			for(const block& b : size_class.second)
+			{
+				encoder::aligned_delete{ b.large_pages, nullptr, size_class.first }(b.memory);
+			}
+		}
+		free_blocks.clear();
+		retained_bytes = 0;
+	}
+
+private:
+	struct block
+	{
+		unsigned char* memory;
+		bool large_pages;
+	};
+
+	// the smallest class that holds size: 4 KiB, or 4, 5, 6 or 7 times a power of two.
+	static size_t size_class(size_t size)
+	{
+		static constexpr size_t smallest_class = 4096;
+		if(size <= smallest_class)
+		{
+			return smallest_class;
+		}
+		size_t step = 1;
+		while((step << 3) < size)
+		{
+			step <<= 1;
+		}
+		return (size + step - 1) & ~(step - 1);
+	}
+
+	encoder::buffer object_buffers(const size_t object_size, const size_t padding_size)
+	{
+		const size_t shard_size = padding_size + e.shard_size_for_object(object_size);
+		encoder::buffer b{ take(shard_size * e.get_shard_count()), shard_size, e.get_shard_count(), padding_size };
+		const size_t payload_size = shard_size - padding_size;
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			std::memset(b.shards[i], 0, padding_size);
+			const size_t payload_start = i * payload_size;
+			if(i < e.get_data_shard_count() && payload_start + payload_size > object_size)
+			{
+				const size_t used = object_size > payload_start ? object_size - payload_start : 0;
+				std::memset(b.shards[i] + padding_size + used, 0, payload_size - used);
+			}
+		}
+		return b;
+	}
+
+	encoder::memory_ptr take(size_t size)
+	{
+		const size_t class_size = size_class(size);
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			std::vector<block>& blocks = free_blocks[class_size];
+			if(!blocks.empty())
+			{
+				const block b = blocks.back();
+				blocks.pop_back();
+				retained_bytes -= class_size;
+				return encoder::memory_ptr{ b.memory, encoder::aligned_delete{ b.large_pages, this, class_size } };
+			}
+		}
+		encoder::memory_ptr fresh = encoder::allocate_memory(class_size, reed_solomon::alignment, huge_pages);
+		const bool large_pages = fresh.get_deleter().large_pages;
+		return encoder::memory_ptr{ fresh.release(), encoder::aligned_delete{ large_pages, this, class_size } };
+	}
+
+	virtual void release(unsigned char* p, size_t size, bool large_pages) override
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			if(retained_bytes + size <= max_retained_bytes)
+			{
+				free_blocks[size].push_back(block{ p, large_pages });
+				retained_bytes += size;
+				return;
+			}
+		}
+		encoder::aligned_delete{ large_pages, nullptr, size }(p);
+	}
+
+	const encoder& e;
+	const size_t max_retained_bytes;
+	const bool huge_pages;
+
+	mutable tbb::spin_mutex mutex;
+	std::unordered_map<size_t, std::vector<block>> free_blocks;
+	size_t retained_bytes;
+};
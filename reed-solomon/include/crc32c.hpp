@@ -0,0 +1,111 @@
+// CRC-32C (Castagnoli) checksums. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <array>
+
+#include <nmmintrin.h>
+
+struct crc32c
+{
+	// reflected form of the Castagnoli polynomial, as used by the SSE4.2 crc32 instruction.
+	static constexpr uint32_t POLYNOMIAL = 0x82f63b78;
+
+	// the crc of data appended to whatever crc was computed over; pass 0 to start afresh.
+	static uint32_t compute(uint32_t crc, const uint8_t* data, size_t length)
+	{
+		crc = ~crc;
+		for(; length != 0 && (reinterpret_cast<size_t>(data) & 7) != 0; --length)
+		{
+			crc = _mm_crc32_u8(crc, *data++);
+		}
+#if defined(_M_X64) || defined(__x86_64__)
+		uint64_t wide = crc;
+		for(; length >= 8; length -= 8, data += 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			wide = _mm_crc32_u64(wide, word);
+		}
+		crc = static_cast<uint32_t>(wide);
+#else
+		for(; length >= 4; length -= 4, data += 4)
+		{
+			uint32_t word;
+			std::memcpy(&word, data, sizeof(word));
+			crc = _mm_crc32_u32(crc, word);
+		}
+#endif
+		for(; length != 0; --length)
+		{
+			crc = _mm_crc32_u8(crc, *data++);
+		}
+		return ~crc;
+	}
+
+	// multiplying a crc by this 32x32 matrix over GF(2) gives the crc of the same data followed by some number of zero bytes.
+	// That's what's needed to join the crcs of two adjacent pieces of data without looking at the data again.
+	typedef std::array<uint32_t, 32> shift_t;
+
+	static shift_t shift_for(size_t length)
+	{
+		// one zero bit
+		shift_t bit;
+		bit[0] = POLYNOMIAL;
+		for(size_t i = 1; i < 32; ++i)
+		{
+			bit[i] = 1u << (i - 1);
+		}
+		shift_t step = compose(bit, bit);
+		step = compose(step, step);
+		step = compose(step, step);
+		shift_t result;
+		for(size_t i = 0; i < 32; ++i)
+		{
+			result[i] = 1u << i;
+		}
+		for(; length != 0; length >>= 1)
+		{
+			if(length & 1)
+			{
+				result = compose(step, result);
+			}
+			step = compose(step, step);
+		}
+		return result;
+	}
+
+	// the crc of a followed by b, given both crcs and the shift for b's length.
+	static uint32_t combine(uint32_t crc_a, uint32_t crc_b, const shift_t& shift_b)
+	{
+		return apply(shift_b, crc_a) ^ crc_b;
+	}
+
+private:
+	static uint32_t apply(const shift_t& m, uint32_t v)
+	{
+		uint32_t result = 0;
+		for(size_t i = 0; v != 0; ++i, v >>= 1)
+		{
+			if(v & 1)
+			{
+				result ^= m[i];
+			}
+		}
+		return result;
+	}
+
+	// a after b.
+	static shift_t compose(const shift_t& a, const shift_t& b)
+	{
+		shift_t result;
+		for(size_t i = 0; i < 32; ++i)
+		{
+			result[i] = apply(a, b[i]);
+		}
+		return result;
+	}
+};
@@ -0,0 +1,236 @@
+// unbuffered shard file I/O. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// what's needed to read a set of shard files back, kept in its own small file so that the shard files hold nothing but
+// block-aligned shard data. The fields are written one after another, 18 bytes in all, so the struct's padding never reaches
+// the file.
+struct direct_shard_header
+{
+	uint64_t object_size;
+	uint64_t shard_size;
+	uint8_t data_shard_count;
+	uint8_t parity_shard_count;
+
+	void save(const std::string& path) const
+	{
+		std::ofstream fout(path, std::ofstream::binary | std::ofstream::trunc);
+		fout.write(reinterpret_cast<const char*>(&object_size), sizeof(object_size));
+		fout.write(reinterpret_cast<const char*>(&shard_size), sizeof(shard_size));
+		fout.write(reinterpret_cast<const char*>(&data_shard_count), sizeof(data_shard_count));
+		fout.write(reinterpret_cast<const char*>(&parity_shard_count), sizeof(parity_shard_count));
+		if(!fout)
+		{
+			throw std::runtime_error("couldn't write shard header");
+		}
+	}
+
+	static direct_shard_header load(const std::string& path)
+	{
+		direct_shard_header header = {};
+		std::ifstream fin(path, std::ifstream::binary);
+		fin.read(reinterpret_cast<char*>(&header.object_size), sizeof(header.object_size));
+		fin.read(reinterpret_cast<char*>(&header.shard_size), sizeof(header.shard_size));
+		fin.read(reinterpret_cast<char*>(&header.data_shard_count), sizeof(header.data_shard_count));
+		fin.read(reinterpret_cast<char*>(&header.parity_shard_count), sizeof(header.parity_shard_count));
+		if(!fin)
+		{
+			throw std::runtime_error("couldn't read shard header");
+		}
+		return header;
+	}
+};
+
+// shard files written and read around the OS's file cache (O_DIRECT, or FILE_FLAG_NO_BUFFERING), so that encoding large objects
+// doesn't evict anything else from it. Unbuffered I/O needs every address, length and file offset to be a multiple of the block
+// size, so buffers must come from allocate_buffers_from_object_size below and carry no padding.
+struct direct_shard_set
+{
+	static constexpr size_t block_size = 4096;
+
+	static encoder::buffer allocate_buffers_from_object_size(const encoder& e, const size_t object_size)
+	{
+		return allocate_buffers_from_shard_size(e, (object_size + e.get_data_shard_count() - 1) / e.get_data_shard_count());
+	}
+
+	// shard_size is rounded up to a whole number of blocks.
+	static encoder::buffer allocate_buffers_from_shard_size(const encoder& e, const size_t shard_size)
+	{
+		// a copy, since std::max would odr-use the static member.
+		const size_t block = block_size;
+		const size_t aligned_shard_size = std::max((shard_size + block - 1) & ~(block - 1), block);
+		return encoder::buffer{ aligned_shard_size * e.get_shard_count(), aligned_shard_size, e.get_shard_count(), 0, true, block_size };
+	}
+
+	// writing creates or truncates every file. Reading opens only the files marked present.
+	direct_shard_set(const std::vector<std::string>& paths, bool writing, const bool* present = nullptr) : files(paths.size(), invalid_file())
+	{
+		try
+		{
+			for(size_t i = 0; i < paths.size(); ++i)
+			{
+				if(writing || present == nullptr || present[i])
+				{
+					files[i] = open(paths[i], writing);
+				}
+			}
+		}
+		catch(...)
+		{
+			close_all();
+			throw;
+		}
+	}
+
+	~direct_shard_set()
+	{
+		close_all();
+	}
+
+	direct_shard_set(const direct_shard_set&) = delete;
+	direct_shard_set& operator=(const direct_shard_set&) = delete;
+
+	// writes shard i of b to file i at file_offset.
+	void write(const encoder::buffer& b, uint64_t file_offset)
+	{
+		check_alignment(b, file_offset);
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			transfer(files[i], b.shards[i], b.shard_size, file_offset, true);
+		}
+	}
+
+	// reads shard i of b from file i at file_offset, for every present shard.
+	void read(encoder::buffer& b, const bool* present, uint64_t file_offset)
+	{
+		check_alignment(b, file_offset);
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			if(present[i])
+			{
+				transfer(files[i], b.shards[i], b.shard_size, file_offset, false);
+			}
+		}
+	}
+
+private:
+#if defined(_WIN32)
+	typedef HANDLE file_t;
+#else
+	typedef int file_t;
+#endif
+
+	// a function rather than a constant, since INVALID_HANDLE_VALUE is a cast, which can't be constexpr.
+	static file_t invalid_file()
+	{
+#if defined(_WIN32)
+		return INVALID_HANDLE_VALUE;
+#else
+		return -1;
+#endif
+	}
+
+	static void check_alignment(const encoder::buffer& b, uint64_t file_offset)
+	{
+		bool aligned = (b.shard_size % block_size) == 0 && (file_offset % block_size) == 0;
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			aligned = aligned && (reinterpret_cast<size_t>(b.shards[i]) % block_size) == 0;
+		}
+		if(!aligned)
+		{
+			throw std::invalid_argument("buffer not aligned for unbuffered I/O");
+		}
+	}
+
+	static file_t open(const std::string& path, bool writing)
+	{
+#if defined(_WIN32)
+		HANDLE file = ::CreateFileA(path.c_str(), writing ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, nullptr, writing ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+		const int flags = writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+		int file = ::open(path.c_str(), flags | O_DIRECT, 0644);
+		if(file == -1 && errno == EINVAL)
+		{
+			// some file systems, such as tmpfs, have no direct I/O; they have no separate cache to bypass, either.
+			file = ::open(path.c_str(), flags, 0644);
+		}
+#endif
+		if(file == invalid_file())
+		{
+			throw std::runtime_error("couldn't open shard file");
+		}
+		return file;
+	}
+
+	static void transfer(file_t file, uint8_t* address, size_t length, uint64_t file_offset, bool writing)
+	{
+		if(file == invalid_file())
+		{
+			throw std::invalid_argument("shard file not open");
+		}
+		while(length != 0)
+		{
+#if defined(_WIN32)
+			// one call moves at most a DWORD's worth; a gigabyte keeps each piece block-aligned.
+			const DWORD piece = static_cast<DWORD>(std::min<size_t>(length, 1024 * 1024 * 1024));
+			OVERLAPPED position = {};
+			position.Offset     = static_cast<DWORD>(file_offset);
+			position.OffsetHigh = static_cast<DWORD>(file_offset >> 32);
+			DWORD transferred = 0;
+			const BOOL succeeded = writing ? ::WriteFile(file, address, piece, &transferred, &position)
+			                               : ::ReadFile (file, address, piece, &transferred, &position);
+			if(!succeeded || transferred == 0)
+			{
+				throw std::runtime_error(writing ? "couldn't write shard file" : "shard file ended early");
+			}
+#else
+			const ssize_t transferred = writing ? ::pwrite(file, address, length, static_cast<off_t>(file_offset))
+			                                    : ::pread (file, address, length, static_cast<off_t>(file_offset));
+			if(transferred <= 0)
+			{
+				if(transferred == -1 && errno == EINTR)
+				{
+					continue;
+				}
+				throw std::runtime_error(writing ? "couldn't write shard file" : "shard file ended early");
+			}
+#endif
+			address     += transferred;
+			length      -= static_cast<size_t>(transferred);
+			file_offset += static_cast<uint64_t>(transferred);
+		}
+	}
+
+	void close_all()
+	{
+		for(file_t& file : files)
+		{
+			if(file != invalid_file())
+			{
+#if defined(_WIN32)
+				::CloseHandle(file);
+#else
+				::close(file);
+#endif
+				file = invalid_file();
+			}
+		}
+	}
+
+	std::vector<file_t> files;
+};
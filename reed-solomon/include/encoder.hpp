@@ -4,65 +4,204 @@
 
 #include "reed-solomon.hpp"
 
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <future>
+#include <new>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
 struct encoder
 {
-	encoder(uint8_t data_shard_count_, uint8_t parity_shard_count_) : rs{data_shard_count_, parity_shard_count_}
+	encoder(uint8_t data_shard_count_, uint8_t parity_shard_count_) : rs{data_shard_count_, parity_shard_count_}, huge_pages(false)
 	{
 	}
 
+	// huge pages are 2 MiB on x86; on Windows the size comes from GetLargePageMinimum.
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	// somewhere other than the heap that buffer memory can come from, and is handed back to when the buffer is destroyed.
+	struct memory_source
+	{
+		virtual void release(unsigned char* p, size_t size, bool large_pages) = 0;
+
+	protected:
+		~memory_source()
+		{
+		}
+	};
+
+	// frees buffer memory the same way it was allocated.
+	struct aligned_delete
+	{
+		void operator()(unsigned char* p) const
+		{
+			if(source)
+			{
+				source->release(p, size, large_pages);
+				return;
+			}
+#if defined(_WIN32)
+			if(large_pages)
+			{
+				::VirtualFree(p, 0, MEM_RELEASE);
+			}
+			else
+			{
+				::_aligned_free(p);
+			}
+#else
+			::free(p);
+#endif
+		}
+
+		bool large_pages;
+		memory_source* source;
+		size_t size;
+	};
+
+	typedef std::unique_ptr<unsigned char[], aligned_delete> memory_ptr;
+
+	// with huge_pages, the memory is rounded up to whole huge pages, and the OS asked to back it with them. That takes far fewer
+	// TLB entries to cover a large shard set. Where huge pages aren't available, ordinary pages are used instead.
+	static memory_ptr allocate_memory(size_t size, size_t memory_alignment, bool huge_pages)
+	{
+		size = std::max<size_t>(size, 1);
+#if defined(_WIN32)
+		// large pages need the SeLockMemoryPrivilege, which most accounts don't have.
+		const size_t large_page_size = huge_pages ? ::GetLargePageMinimum() : 0;
+		if(large_page_size != 0)
+		{
+			void* p = ::VirtualAlloc(nullptr, (size + large_page_size - 1) & ~(large_page_size - 1), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if(p != nullptr)
+			{
+				return memory_ptr{ static_cast<unsigned char*>(p), aligned_delete{ true, nullptr, size } };
+			}
+		}
+		void* p = ::_aligned_malloc(size, memory_alignment);
+#else
+		if(huge_pages)
+		{
+			// a copy, since std::max would odr-use the static member.
+			const size_t huge_page = huge_page_size;
+			memory_alignment = std::max(memory_alignment, huge_page);
+			size = (size + huge_page - 1) & ~(huge_page - 1);
+		}
+		void* p = nullptr;
+		if(::posix_memalign(&p, memory_alignment, size) != 0)
+		{
+			p = nullptr;
+		}
+#if defined(MADV_HUGEPAGE)
+		if(p != nullptr && huge_pages)
+		{
+			::madvise(p, size, MADV_HUGEPAGE);
+		}
+#endif
+#endif
+		if(p == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return memory_ptr{ static_cast<unsigned char*>(p), aligned_delete{ false, nullptr, size } };
+	}
+
 	struct buffer
 	{
-		buffer(size_t buffer_size_, size_t shard_size_, size_t shard_count_, size_t padding_size_) : buffer_size(buffer_size_),
-		                                                                                             shard_size(shard_size_),
-		                                                                                             shard_count(shard_count_),
-		                                                                                             padding_size(padding_size_),
-		                                                                                             data {new unsigned char[buffer_size] },
-		                                                                                             shards { new unsigned char*[shard_count] }
+		// without zero_fill, the memory is left untouched so that its pages can be placed by whichever thread first writes to them.
+		// memory_alignment must be a power of two; a larger one than the default lets shards be used for unbuffered file I/O.
+		buffer(size_t buffer_size_, size_t shard_size_, size_t shard_count_, size_t padding_size_, bool zero_fill = true, size_t memory_alignment = reed_solomon::alignment, bool huge_pages = false) : buffer_size(buffer_size_),
+		                                                                                                                                                                                         shard_size(shard_size_),
+		                                                                                                                                                                                         shard_count(shard_count_),
+		                                                                                                                                                                                         padding_size(padding_size_),
+		                                                                                                                                                                                         data { allocate_memory(buffer_size, memory_alignment, huge_pages) },
+		                                                                                                                                                                                         shards { new unsigned char*[shard_count] }
 		{
-			std::memset(data.get(), 0, buffer_size);
+			if(zero_fill)
+			{
+				std::memset(data.get(), 0, buffer_size);
+			}
 			for(size_t i = 0; i < shard_count; ++i)
 			{
 				shards[i] = &data[i * shard_size];
 			}
 		}
 	
+		// adopts memory that's already been obtained, at least shard_size_ * shard_count_ bytes of it, and leaves its contents as they are.
+		buffer(memory_ptr memory, size_t shard_size_, size_t shard_count_, size_t padding_size_) : buffer_size(shard_size_ * shard_count_),
+		                                                                                          shard_size(shard_size_),
+		                                                                                          shard_count(shard_count_),
+		                                                                                          padding_size(padding_size_),
+		                                                                                          data { std::move(memory) },
+		                                                                                          shards { new unsigned char*[shard_count] }
+		{
+			for(size_t i = 0; i < shard_count; ++i)
+			{
+				shards[i] = &data[i * shard_size];
+			}
+		}
+
 		const size_t buffer_size;
 		const size_t shard_size;
 		const size_t shard_count;
 		const size_t padding_size;
 
-		std::unique_ptr<unsigned char[]> data;
+		memory_ptr data;
 		std::unique_ptr<unsigned char*[]> shards;
 	};
 
+	// the aligned number of bytes each shard needs to hold its share of an object, excluding padding.
+	size_t shard_size_for_object(const size_t object_size) const
+	{
+		return (((object_size + rs.get_data_shard_count() - 1) / rs.get_data_shard_count()) + reed_solomon::alignment) & ~(reed_solomon::alignment - 1);
+	}
+
+	static size_t padding_size_for(const size_t minimum_padding)
+	{
+		return (minimum_padding + reed_solomon::alignment) & ~(reed_solomon::alignment - 1);
+	}
+
 	buffer allocate_buffers_from_object_size(const size_t object_size) const
 	{
-		const size_t shard_size = (((object_size + rs.get_data_shard_count() - 1) / rs.get_data_shard_count()) + reed_solomon::alignment) & ~(reed_solomon::alignment - 1);
+		const size_t shard_size = shard_size_for_object(object_size);
 		const size_t buffer_size = shard_size * get_shard_count();
 
-		return buffer{ buffer_size, shard_size, get_shard_count(), 0 };
+		return buffer{ buffer_size, shard_size, get_shard_count(), 0, true, reed_solomon::alignment, huge_pages };
 	}
 
 	buffer allocate_buffers_from_object_size(const size_t object_size, const size_t minimum_padding) const
 	{
-		const size_t padding_size = (minimum_padding + reed_solomon::alignment) & ~(reed_solomon::alignment - 1);
-		const size_t shard_size   = padding_size + ((((object_size + rs.get_data_shard_count() - 1) / rs.get_data_shard_count()) + reed_solomon::alignment) & ~(reed_solomon::alignment - 1));
+		const size_t padding_size = padding_size_for(minimum_padding);
+		const size_t shard_size   = padding_size + shard_size_for_object(object_size);
 		const size_t buffer_size  = shard_size * get_shard_count();
 
-		return buffer{ buffer_size, shard_size, get_shard_count(), padding_size };
+		return buffer{ buffer_size, shard_size, get_shard_count(), padding_size, true, reed_solomon::alignment, huge_pages };
 	}
 
 	buffer allocate_buffers_from_shard_size(const size_t shard_size) const
 	{
 		const size_t buffer_size = shard_size * get_shard_count();
-		return buffer{ buffer_size, shard_size, get_shard_count(), 0 };
+		return buffer{ buffer_size, shard_size, get_shard_count(), 0, true, reed_solomon::alignment, huge_pages };
 	}
 
 	buffer allocate_buffers_from_shard_size(const size_t shard_size, const size_t minimum_padding) const
 	{
-		const size_t padding_size = (minimum_padding + reed_solomon::alignment) & ~(reed_solomon::alignment - 1);
+		const size_t padding_size = padding_size_for(minimum_padding);
 		const size_t buffer_size = shard_size * get_shard_count();
-		return buffer{ buffer_size, shard_size, get_shard_count(), padding_size };
+		return buffer{ buffer_size, shard_size, get_shard_count(), padding_size, true, reed_solomon::alignment, huge_pages };
+	}
+
+	// just the parity shards for an object, for encode_object.
+	buffer allocate_parity_buffers_from_object_size(const size_t object_size) const
+	{
+		const size_t shard_size = shard_size_for_object(object_size);
+		return buffer{ shard_size * rs.get_parity_shard_count(), shard_size, rs.get_parity_shard_count(), 0, false, reed_solomon::alignment, huge_pages };
 	}
 
 	uint8_t get_data_shard_count() const
@@ -70,25 +209,331 @@ struct encoder
 		return rs.get_data_shard_count();
 	}
 
+	uint8_t get_parity_shard_count() const
+	{
+		return rs.get_parity_shard_count();
+	}
+
 	uint8_t get_shard_count() const
 	{
 		return rs.get_total_shard_count();
 	}
 
-	void encode(buffer& b) const
+	// buffers allocated from now on are backed by huge pages where the OS allows it.
+	void set_huge_pages(bool use_huge_pages)
+	{
+		huge_pages = use_huge_pages;
+	}
+
+	void set_cache_budget(size_t budget)
+	{
+		rs.set_cache_budget(budget);
+	}
+
+	void set_arena(tbb::task_arena* arena, int max_concurrency = tbb::task_arena::automatic)
+	{
+		rs.set_arena(arena, max_concurrency);
+	}
+
+	void set_max_concurrency(int max_concurrency)
+	{
+		rs.set_max_concurrency(max_concurrency);
+	}
+
+	void set_isolation(bool isolate)
+	{
+		rs.set_isolation(isolate);
+	}
+
+	void set_serial_threshold(size_t threshold)
 	{
-		rs.encode_parity(b.shards.get(), b.padding_size, b.shard_size - b.padding_size);
+		rs.set_serial_threshold(threshold);
 	}
 
-	bool verify(buffer& b) const
+	size_t autotune_serial_threshold()
 	{
-		return rs.is_parity_correct(const_cast<const uint8_t**>(b.shards.get()), b.padding_size, b.shard_size - b.padding_size);
+		return rs.autotune_serial_threshold();
 	}
 
-	bool repair(buffer& b, bool* present)
+	void encode(buffer& b, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
 	{
-		return rs.decode_missing(b.shards.get(), present, b.padding_size, b.shard_size - b.padding_size);
+		rs.encode_parity(b.shards.get(), b.padding_size, b.shard_size - b.padding_size, policy);
+	}
+
+	// encodes, and checksums every shard's data in the same pass. See reed_solomon::encode_parity_with_checksums.
+	void encode_with_checksums(buffer& b, uint32_t* shard_checksums, uint32_t* block_checksums = nullptr, size_t block_size = reed_solomon::default_checksum_block_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		rs.encode_parity_with_checksums(b.shards.get(), b.padding_size, b.shard_size - b.padding_size, shard_checksums, block_checksums, block_size, policy);
+	}
+
+	// encodes an object where it lies. Data shard i is bytes [i * shard_size, (i + 1) * shard_size) of the object, read in place,
+	// with zeros standing in beyond its end, so the object is never copied. Only the parity shards are written.
+	void encode_object(const uint8_t* object, size_t object_size, buffer& parity, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		const size_t shard_size = shard_size_for_object(object_size);
+		if(parity.shard_count != rs.get_parity_shard_count() || parity.shard_size != shard_size || parity.padding_size != 0)
+		{
+			throw std::invalid_argument("parity buffer doesn't match object");
+		}
+		static const uint8_t zeros[4096] = {};
+		std::vector<reed_solomon::segment> segments;
+		std::vector<size_t> segment_counts;
+		for(size_t i = 0; i < rs.get_data_shard_count(); ++i)
+		{
+			const size_t first_segment = segments.size();
+			const size_t begin = std::min(i * shard_size, object_size);
+			const size_t end   = std::min(begin + shard_size, object_size);
+			if(end != begin)
+			{
+				segments.push_back(reed_solomon::segment{ object + begin, end - begin });
+			}
+			for(size_t remaining = shard_size - (end - begin); remaining != 0; )
+			{
+				const size_t length = std::min(remaining, sizeof(zeros));
+				segments.push_back(reed_solomon::segment{ zeros, length });
+				remaining -= length;
+			}
+			segment_counts.push_back(segments.size() - first_segment);
+		}
+		std::vector<reed_solomon::shard_view> views;
+		for(size_t i = 0, first_segment = 0; i < segment_counts.size(); first_segment += segment_counts[i], ++i)
+		{
+			views.push_back(reed_solomon::shard_view{ segments.data() + first_segment, segment_counts[i] });
+		}
+		rs.encode_parity(views.data(), parity.shards.get(), 0, shard_size, policy);
+	}
+
+	// overwrites bytes [offset, offset + length) of one data shard of an encoded buffer, and brings the parity up to date
+	// without re-encoding the whole stripe.
+	void update(buffer& b, uint8_t data_shard, size_t offset, const uint8_t* data, size_t length, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		if(data_shard >= rs.get_data_shard_count() || offset + length > b.shard_size - b.padding_size)
+		{
+			throw std::out_of_range("outside the data shard");
+		}
+		uint8_t* const target = b.shards[data_shard] + b.padding_size + offset;
+		rs.update_parity(data_shard, b.padding_size + offset, target, data, length, &b.shards[rs.get_data_shard_count()], policy);
+		std::memcpy(target, data, length);
+	}
+
+	// adds bytes [offset, offset + length) of data shard data_shard into a parity-only buffer.
+	void add_to_parity(uint8_t data_shard, const uint8_t* data, size_t offset, size_t length, buffer& parity, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		if(parity.shard_count != rs.get_parity_shard_count() || offset + length > parity.shard_size - parity.padding_size)
+		{
+			throw std::out_of_range("outside the parity buffer");
+		}
+		rs.add_to_parity(data_shard, data, parity.shards.get(), parity.padding_size + offset, length, policy);
+	}
+
+	// cancelling the optional context abandons the verification, and false is returned.
+	bool verify(buffer& b, tbb::task_group_context* cancellation = nullptr, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		return rs.is_parity_correct(const_cast<const uint8_t**>(b.shards.get()), b.padding_size, b.shard_size - b.padding_size, cancellation, policy);
+	}
+
+	bool repair(buffer& b, bool* present, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic)
+	{
+		return rs.decode_missing(b.shards.get(), present, b.padding_size, b.shard_size - b.padding_size, policy);
+	}
+
+	// rebuilds only the damaged blocks of each shard's data. See reed_solomon::decode_damaged_blocks.
+	bool repair_blocks(buffer& b, const reed_solomon::damage_map& damage, size_t block_size = reed_solomon::default_checksum_block_size)
+	{
+		return rs.decode_damaged_blocks(b.shards.get(), damage, b.padding_size, b.shard_size - b.padding_size, block_size);
+	}
+
+	// verify and repair shards kept outside a buffer, such as a mapped_shard_set. Every shard is shard_size bytes, the first padding_size of which are padding.
+	bool verify(uint8_t** shards, size_t shard_size, size_t padding_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		return rs.is_parity_correct(const_cast<const uint8_t**>(shards), padding_size, shard_size - padding_size, nullptr, policy);
+	}
+
+	bool repair(uint8_t** shards, bool* present, size_t shard_size, size_t padding_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic)
+	{
+		return rs.decode_missing(shards, present, padding_size, shard_size - padding_size, policy);
+	}
+
+	// the async functions return at once and run on TBB workers, so that an event loop never blocks on coding. The encoder, the
+	// buffer, and present must all stay alive until the completion has been called or the future is ready. Completions run on a
+	// TBB worker and must not throw; they're given the exception coding threw, if any, which the future overloads rethrow from get().
+	void encode_async(buffer& b, std::function<void(std::exception_ptr)> completion) const
+	{
+		rs.enqueue([this, &b, completion]
+		{
+			std::exception_ptr failure;
+			try
+			{
+				encode(b);
+			}
+			catch(...)
+			{
+				failure = std::current_exception();
+			}
+			completion(failure);
+		});
+	}
+
+	// the result is false whenever there's an exception.
+	void verify_async(buffer& b, std::function<void(bool, std::exception_ptr)> completion) const
+	{
+		rs.enqueue([this, &b, completion]
+		{
+			bool result = false;
+			std::exception_ptr failure;
+			try
+			{
+				result = verify(b);
+			}
+			catch(...)
+			{
+				failure = std::current_exception();
+			}
+			completion(result, failure);
+		});
+	}
+
+	void repair_async(buffer& b, bool* present, std::function<void(bool, std::exception_ptr)> completion)
+	{
+		rs.enqueue([this, &b, present, completion]
+		{
+			bool result = false;
+			std::exception_ptr failure;
+			try
+			{
+				result = repair(b, present);
+			}
+			catch(...)
+			{
+				failure = std::current_exception();
+			}
+			completion(result, failure);
+		});
+	}
+
+	std::future<void> encode_async(buffer& b) const
+	{
+		return run_async([this, &b]
+		{
+			encode(b);
+		});
+	}
+
+	std::future<bool> verify_async(buffer& b) const
+	{
+		return run_async([this, &b]
+		{
+			return verify(b);
+		});
+	}
+
+	std::future<bool> repair_async(buffer& b, bool* present)
+	{
+		return run_async([this, &b, present]
+		{
+			return repair(b, present);
+		});
+	}
+
+	// the batch functions encode, verify or repair many independent buffers as one pool of parallel work.
+	void encode_batch(buffer* buffers, size_t buffer_count) const
+	{
+		std::vector<reed_solomon::stripe> stripes = make_stripes(buffers, buffer_count, nullptr);
+		rs.encode_batch(stripes.data(), stripes.size());
+	}
+
+	void verify_batch(buffer* buffers, size_t buffer_count, bool* results) const
+	{
+		std::vector<reed_solomon::stripe> stripes = make_stripes(buffers, buffer_count, nullptr);
+		rs.verify_batch(stripes.data(), stripes.size(), results);
+	}
+
+	// present[i] describes buffers[i].
+	void repair_batch(buffer* buffers, bool* const* present, size_t buffer_count, bool* results) const
+	{
+		std::vector<reed_solomon::stripe> stripes = make_stripes(buffers, buffer_count, present);
+		rs.decode_batch(stripes.data(), stripes.size(), results);
+	}
+
+	std::vector<reed_solomon::corrupt_range> locate_corruption(buffer& b) const
+	{
+		return rs.locate_corruption(const_cast<const uint8_t**>(b.shards.get()), b.padding_size, b.shard_size - b.padding_size);
+	}
+
+	// rebuilds silently corrupted bytes in place. Returns false, having changed nothing, if the damage couldn't be attributed to
+	// individual shards.
+	bool repair_corruption(buffer& b)
+	{
+		const std::vector<reed_solomon::corrupt_range> ranges = locate_corruption(b);
+		for(const reed_solomon::corrupt_range& range : ranges)
+		{
+			if(range.shard == reed_solomon::unknown_shard)
+			{
+				return false;
+			}
+		}
+		// each byte is attributed to at most one shard, so within a run every other shard is clean and can be decoded from.
+		// Runs are rebuilt one at a time; decoding a span covering several would read other shards' bad bytes between them.
+		std::unique_ptr<bool[]> present{ new bool[get_shard_count()] };
+		for(const reed_solomon::corrupt_range& range : ranges)
+		{
+			std::fill(present.get(), present.get() + get_shard_count(), true);
+			present[range.shard] = false;
+			if(!rs.decode_missing(b.shards.get(), present.get(), range.offset, range.length))
+			{
+				return false;
+			}
+		}
+		return true;
 	}
 private:
+	static std::vector<reed_solomon::stripe> make_stripes(buffer* buffers, size_t buffer_count, bool* const* present)
+	{
+		std::vector<reed_solomon::stripe> stripes;
+		stripes.reserve(buffer_count);
+		for(size_t i = 0; i < buffer_count; ++i)
+		{
+			stripes.push_back(reed_solomon::stripe{ buffers[i].shards.get(), buffers[i].padding_size, buffers[i].shard_size - buffers[i].padding_size, present ? present[i] : nullptr });
+		}
+		return stripes;
+	}
+
+	// runs work on a TBB worker, and delivers its result or exception through the future.
+	template <typename F>
+	auto run_async(F work) const -> std::future<decltype(work())>
+	{
+		typedef decltype(work()) result_type;
+		std::shared_ptr<std::promise<result_type>> promise = std::make_shared<std::promise<result_type>>();
+		std::future<result_type> result = promise->get_future();
+		rs.enqueue([promise, work]
+		{
+			try
+			{
+				fulfil(*promise, work);
+			}
+			catch(...)
+			{
+				promise->set_exception(std::current_exception());
+			}
+		});
+		return result;
+	}
+
+	template <typename T, typename F>
+	static void fulfil(std::promise<T>& promise, F& work)
+	{
+		promise.set_value(work());
+	}
+
+	template <typename F>
+	static void fulfil(std::promise<void>& promise, F& work)
+	{
+		work();
+		promise.set_value();
+	}
+
+	friend struct numa_encoder;
+
 	reed_solomon rs;
+	bool huge_pages;
 };
@@ -0,0 +1,179 @@
+// streaming file encoding. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <istream>
+#include <ostream>
+
+// encodes a stream of any length as a sequence of fixed-size stripes, reading, encoding and writing several stripes at once
+// in a pipeline. Memory use is bounded by the number of stripes in flight, not by the size of the stream.
+// Each shard stream receives one shard of every stripe, one after another; the last stripe is zero-filled.
+struct file_encoder
+{
+	static constexpr size_t default_stripe_shard_size = 1024 * 1024;
+
+	file_encoder(uint8_t data_shard_count_, uint8_t parity_shard_count_, size_t stripe_shard_size_ = default_stripe_shard_size, size_t max_stripes_in_flight_ = 0) : e{ data_shard_count_, parity_shard_count_ },
+	                                                                                                                                                              stripe_shard_size((stripe_shard_size_ + reed_solomon::alignment - 1) & ~(reed_solomon::alignment - 1)),
+	                                                                                                                                                              max_stripes_in_flight(max_stripes_in_flight_ != 0 ? max_stripes_in_flight_ : 2 * tbb::task_scheduler_init::default_num_threads())
+	{
+	}
+
+	encoder& get_encoder()
+	{
+		return e;
+	}
+
+	size_t get_stripe_shard_size() const
+	{
+		return stripe_shard_size;
+	}
+
+	// the number of bytes written to each shard stream for an input of input_size bytes.
+	uint64_t shard_stream_size(uint64_t input_size) const
+	{
+		const uint64_t stripe_data_size = static_cast<uint64_t>(stripe_shard_size) * e.get_data_shard_count();
+		return ((input_size + stripe_data_size - 1) / stripe_data_size) * stripe_shard_size;
+	}
+
+	// reads in until it ends, and writes every shard i to shards[i]. Returns the number of bytes read, which decode_file needs.
+	uint64_t encode_file(std::istream& in, std::ostream* const* shards)
+	{
+		stripe_buffers buffers(e, stripe_shard_size, max_stripes_in_flight);
+		uint64_t input_size = 0;
+		tbb::parallel_pipeline(max_stripes_in_flight,
+			tbb::make_filter<void, encoder::buffer*>(tbb::filter::serial_in_order, [&](tbb::flow_control& fc) -> encoder::buffer*
+			{
+				encoder::buffer* b = buffers.take();
+				size_t bytes_read = 0;
+				for(size_t i = 0; i < e.get_data_shard_count(); ++i)
+				{
+					in.read(reinterpret_cast<char*>(b->shards[i]), stripe_shard_size);
+					const size_t shard_bytes = static_cast<size_t>(in.gcount());
+					std::memset(b->shards[i] + shard_bytes, 0, stripe_shard_size - shard_bytes);
+					bytes_read += shard_bytes;
+				}
+				if(bytes_read == 0)
+				{
+					buffers.give_back(b);
+					fc.stop();
+					return nullptr;
+				}
+				input_size += bytes_read;
+				return b;
+			}) &
+			tbb::make_filter<encoder::buffer*, encoder::buffer*>(tbb::filter::parallel, [&](encoder::buffer* b)
+			{
+				e.encode(*b);
+				return b;
+			}) &
+			tbb::make_filter<encoder::buffer*, void>(tbb::filter::serial_in_order, [&](encoder::buffer* b)
+			{
+				for(size_t i = 0; i < e.get_shard_count(); ++i)
+				{
+					if(!shards[i]->write(reinterpret_cast<const char*>(b->shards[i]), stripe_shard_size))
+					{
+						buffers.give_back(b);
+						throw std::runtime_error("couldn't write shard");
+					}
+				}
+				buffers.give_back(b);
+			})
+		);
+		return input_size;
+	}
+
+	// reads the shard streams written by encode_file, rebuilding any that aren't present, and writes the first input_size bytes
+	// of the original to out. shards[i] is ignored when present[i] is false. Returns false if too few shards are present.
+	bool decode_file(std::istream* const* shards, bool* present, uint64_t input_size, std::ostream& out)
+	{
+		stripe_buffers buffers(e, stripe_shard_size, max_stripes_in_flight);
+		// the input filter runs ahead of the output filter, so each keeps its own count: the input filter of the stripes it has
+		// read, the output filter of the bytes it has still to write.
+		const uint64_t stripe_data_size = static_cast<uint64_t>(stripe_shard_size) * e.get_data_shard_count();
+		const uint64_t stripe_count = (input_size + stripe_data_size - 1) / stripe_data_size;
+		uint64_t stripes_read = 0;
+		uint64_t bytes_remaining = input_size;
+		tbb::atomic<bool> repaired;
+		repaired = true;
+		tbb::parallel_pipeline(max_stripes_in_flight,
+			tbb::make_filter<void, encoder::buffer*>(tbb::filter::serial_in_order, [&](tbb::flow_control& fc) -> encoder::buffer*
+			{
+				if(stripes_read == stripe_count || !repaired)
+				{
+					fc.stop();
+					return nullptr;
+				}
+				encoder::buffer* b = buffers.take();
+				for(size_t i = 0; i < e.get_shard_count(); ++i)
+				{
+					if(present[i] && !shards[i]->read(reinterpret_cast<char*>(b->shards[i]), stripe_shard_size))
+					{
+						buffers.give_back(b);
+						throw std::runtime_error("shard ended early");
+					}
+				}
+				++stripes_read;
+				return b;
+			}) &
+			tbb::make_filter<encoder::buffer*, encoder::buffer*>(tbb::filter::parallel, [&](encoder::buffer* b)
+			{
+				if(!e.repair(*b, present))
+				{
+					repaired = false;
+				}
+				return b;
+			}) &
+			tbb::make_filter<encoder::buffer*, void>(tbb::filter::serial_in_order, [&](encoder::buffer* b)
+			{
+				for(size_t i = 0; i < e.get_data_shard_count() && bytes_remaining != 0 && repaired; ++i)
+				{
+					const size_t bytes = static_cast<size_t>(std::min<uint64_t>(stripe_shard_size, bytes_remaining));
+					if(!out.write(reinterpret_cast<const char*>(b->shards[i]), bytes))
+					{
+						buffers.give_back(b);
+						throw std::runtime_error("couldn't write output");
+					}
+					bytes_remaining -= bytes;
+				}
+				buffers.give_back(b);
+			})
+		);
+		return repaired;
+	}
+
+private:
+	// the stripes in flight. The pipeline never has more tokens than there are buffers, so take() always finds one.
+	struct stripe_buffers
+	{
+		stripe_buffers(const encoder& e, size_t shard_size, size_t buffer_count)
+		{
+			buffers.reserve(buffer_count);
+			for(size_t i = 0; i < buffer_count; ++i)
+			{
+				buffers.push_back(e.allocate_buffers_from_shard_size(shard_size));
+				available.push(&buffers.back());
+			}
+		}
+
+		encoder::buffer* take()
+		{
+			encoder::buffer* b = nullptr;
+			available.try_pop(b);
+			return b;
+		}
+
+		void give_back(encoder::buffer* b)
+		{
+			available.push(b);
+		}
+
+		std::vector<encoder::buffer> buffers;
+		tbb::concurrent_queue<encoder::buffer*> available;
+	};
+
+	encoder e;
+	const size_t stripe_shard_size;
+	const size_t max_stripes_in_flight;
+};
@@ -0,0 +1,226 @@
+// locally repairable codes. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "reed-solomon.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// an Azure-style locally repairable code. The data shards are split into equal local groups, each protected by an XOR parity
+// shard of its own, and all of the data is protected by global Reed-Solomon parity shards as well. A single lost shard in a
+// group is rebuilt from the rest of its group, reading data_shard_count / local_group_count shards instead of data_shard_count;
+// the global parity is only needed when a group loses more than one. Shards are ordered data first, then the local parity of
+// each group, then the global parity.
+struct lrc
+{
+	lrc(uint8_t data_shard_count_, uint8_t local_group_count_, uint8_t global_parity_count_) : data_shard_count(data_shard_count_),
+	                                                                                            local_group_count(local_group_count_),
+	                                                                                            global_parity_count(global_parity_count_),
+	                                                                                            group_size(local_group_count_ != 0 ? data_shard_count_ / local_group_count_ : 0),
+	                                                                                            code(data_shard_count_, local_group_count_ + global_parity_count_, build_matrix(data_shard_count_, local_group_count_, global_parity_count_)),
+	                                                                                            local_code(group_size, 1, build_matrix(group_size, 1, 0))
+	{
+	}
+
+	uint8_t get_data_shard_count() const
+	{
+		return data_shard_count;
+	}
+
+	uint8_t get_parity_shard_count() const
+	{
+		return local_group_count + global_parity_count;
+	}
+
+	uint8_t get_shard_count() const
+	{
+		return data_shard_count + local_group_count + global_parity_count;
+	}
+
+	uint8_t get_local_group_count() const
+	{
+		return local_group_count;
+	}
+
+	uint8_t get_global_parity_count() const
+	{
+		return global_parity_count;
+	}
+
+	// the local group a data or local parity shard belongs to; global parity belongs to none.
+	uint8_t group_of(uint8_t shard) const
+	{
+		return shard < data_shard_count ? shard / group_size
+		     : shard < data_shard_count + local_group_count ? shard - data_shard_count
+		     : no_group;
+	}
+
+	static constexpr uint8_t no_group = 0xff;
+
+	void encode_parity(uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		code.encode_parity(shards, offset, shard_size, policy);
+	}
+
+	bool is_parity_correct(const uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		return code.is_parity_correct(shards, offset, shard_size, nullptr, policy);
+	}
+
+	// how a set of lost shards will be rebuilt, and what that costs.
+	struct repair_plan
+	{
+		// false if too many shards are lost.
+		bool possible;
+		// lost shards each rebuilt from the rest of their group, in order.
+		std::vector<uint8_t> local_repairs;
+		// lost shards left for the global decode, which reads data_shard_count shards.
+		std::vector<uint8_t> global_repairs;
+		// for each shard, whether the repair reads it.
+		std::vector<bool> reads;
+
+		size_t shards_read() const
+		{
+			return static_cast<size_t>(std::count(reads.begin(), reads.end(), true));
+		}
+	};
+
+	// prefers local repair: every group missing just one shard is rebuilt from its own members. Anything still missing after
+	// that is decoded from the whole stripe, using any shards rebuilt locally.
+	repair_plan plan_repair(const bool* shard_present) const
+	{
+		repair_plan plan;
+		plan.reads.assign(get_shard_count(), false);
+		std::vector<bool> available(shard_present, shard_present + get_shard_count());
+		for(uint8_t group = 0; group < local_group_count; ++group)
+		{
+			const std::vector<uint8_t> members = group_members(group);
+			const size_t missing = static_cast<size_t>(std::count_if(members.begin(), members.end(), [&](uint8_t shard) { return !shard_present[shard]; }));
+			if(missing != 1)
+			{
+				continue;
+			}
+			for(uint8_t shard : members)
+			{
+				if(shard_present[shard])
+				{
+					plan.reads[shard] = true;
+				}
+				else
+				{
+					plan.local_repairs.push_back(shard);
+					available[shard] = true;
+				}
+			}
+		}
+		for(uint8_t shard = 0; shard < get_shard_count(); ++shard)
+		{
+			if(!available[shard])
+			{
+				plan.global_repairs.push_back(shard);
+			}
+		}
+		plan.possible = true;
+		if(!plan.global_repairs.empty())
+		{
+			std::unique_ptr<bool[]> present{ new bool[get_shard_count()] };
+			std::copy(available.begin(), available.end(), present.get());
+			std::unique_ptr<uint8_t[]> chosen{ new uint8_t[data_shard_count] };
+			plan.possible = code.choose_decoding_shards(present.get(), chosen.get());
+			for(uint8_t i = 0; i < data_shard_count && plan.possible; ++i)
+			{
+				plan.reads[chosen[i]] = plan.reads[chosen[i]] || shard_present[chosen[i]];
+			}
+			// lost parity is re-encoded from every data shard.
+			const bool parity_lost = std::any_of(plan.global_repairs.begin(), plan.global_repairs.end(), [&](uint8_t shard) { return shard >= data_shard_count; });
+			for(uint8_t shard = 0; shard < data_shard_count && parity_lost; ++shard)
+			{
+				plan.reads[shard] = plan.reads[shard] || shard_present[shard];
+			}
+		}
+		return plan;
+	}
+
+	// rebuilds the shards that aren't present, as plan_repair describes. Returns false, having changed nothing, if too many are
+	// lost.
+	bool decode_missing(uint8_t* __restrict* __restrict shards, const bool* shard_present, size_t offset, size_t shard_size, reed_solomon::execution_policy policy = reed_solomon::execution_policy::automatic) const
+	{
+		const repair_plan plan = plan_repair(shard_present);
+		if(!plan.possible)
+		{
+			return false;
+		}
+		// the other members of a group, all with coefficient 1, XOR together to give the lost one.
+		std::vector<uint8_t*> local_shards(group_size + 1);
+		for(uint8_t lost : plan.local_repairs)
+		{
+			size_t input = 0;
+			for(uint8_t shard : group_members(group_of(lost)))
+			{
+				if(shard != lost)
+				{
+					local_shards[input++] = shards[shard];
+				}
+			}
+			local_shards[group_size] = shards[lost];
+			local_code.encode_parity(local_shards.data(), offset, shard_size, policy);
+		}
+		if(!plan.global_repairs.empty())
+		{
+			std::unique_ptr<bool[]> present{ new bool[get_shard_count()] };
+			std::copy(shard_present, shard_present + get_shard_count(), present.get());
+			for(uint8_t shard : plan.local_repairs)
+			{
+				present[shard] = true;
+			}
+			code.decode_missing(shards, present.get(), offset, shard_size, policy);
+		}
+		return true;
+	}
+
+private:
+	// each group's data shards, then its local parity.
+	std::vector<uint8_t> group_members(uint8_t group) const
+	{
+		std::vector<uint8_t> members;
+		for(uint8_t i = 0; i < group_size; ++i)
+		{
+			members.push_back(static_cast<uint8_t>((group * group_size) + i));
+		}
+		members.push_back(static_cast<uint8_t>(data_shard_count + group));
+		return members;
+	}
+
+	// identity, then a row of ones over each group, then row p of the global parity gives data shard i the coefficient
+	// g_i^(p + 1), where g_i = 2^i. Together with the local rows, which are the zeroth powers, any global_parity_count + 1 lost
+	// shards of one group form a Vandermonde system, so every loss of that many shards can be rebuilt.
+	static matrix build_matrix(uint8_t data_shard_count, uint8_t local_group_count, uint8_t global_parity_count)
+	{
+		if(local_group_count == 0 || data_shard_count % local_group_count != 0)
+		{
+			throw std::invalid_argument("data shards must divide evenly into local groups");
+		}
+		const uint8_t group_size = data_shard_count / local_group_count;
+		matrix result{ static_cast<size_t>(data_shard_count) + local_group_count + global_parity_count, data_shard_count };
+		for(uint8_t i = 0; i < data_shard_count; ++i)
+		{
+			result.set(i, i, 1);
+			result.set(data_shard_count + (i / group_size), i, 1);
+			for(uint8_t p = 0; p < global_parity_count; ++p)
+			{
+				result.set(data_shard_count + local_group_count + p, i, galois.exp(galois.exp(2, i), p + 1));
+			}
+		}
+		return result;
+	}
+
+	const uint8_t data_shard_count;
+	const uint8_t local_group_count;
+	const uint8_t global_parity_count;
+	const uint8_t group_size;
+	// the whole code, local parity included, for encoding and for global decoding.
+	const reed_solomon code;
+	// XOR over one group.
+	const reed_solomon local_code;
+};
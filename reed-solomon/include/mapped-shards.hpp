@@ -0,0 +1,206 @@
+// memory-mapped shard files. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a set of shard files mapped straight into memory, so that verification and repair read and write the page cache without
+// copying through the heap. Present shards are mapped read-only; missing shards are created at full size and mapped writable,
+// ready to be rebuilt in place.
+struct mapped_shard_set
+{
+	// shard_size 0 takes the size of the first present file.
+	mapped_shard_set(const std::vector<std::string>& paths, const bool* present, size_t shard_size_ = 0) : shard_size(shard_size_),
+	                                                                                                        files(paths.size()),
+	                                                                                                        shards{ new uint8_t*[paths.size()] }
+	{
+		try
+		{
+			for(size_t i = 0; i < paths.size() && shard_size == 0; ++i)
+			{
+				if(present[i])
+				{
+					shard_size = file_size(paths[i]);
+				}
+			}
+			if(shard_size == 0)
+			{
+				throw std::runtime_error("no shard size");
+			}
+			for(size_t i = 0; i < paths.size(); ++i)
+			{
+				map(files[i], paths[i], present[i]);
+				shards[i] = static_cast<uint8_t*>(files[i].address);
+			}
+		}
+		catch(...)
+		{
+			unmap_all();
+			throw;
+		}
+	}
+
+	~mapped_shard_set()
+	{
+		unmap_all();
+	}
+
+	mapped_shard_set(const mapped_shard_set&) = delete;
+	mapped_shard_set& operator=(const mapped_shard_set&) = delete;
+
+	uint8_t** get_shards() const
+	{
+		return shards.get();
+	}
+
+	size_t get_shard_size() const
+	{
+		return shard_size;
+	}
+
+	size_t get_shard_count() const
+	{
+		return files.size();
+	}
+
+	// writes rebuilt shards back to their files, rather than leaving it to the OS.
+	void flush() const
+	{
+		for(const mapped_file& file : files)
+		{
+			if(file.writable)
+			{
+#if defined(_WIN32)
+				::FlushViewOfFile(file.address, shard_size);
+				::FlushFileBuffers(file.file);
+#else
+				::msync(file.address, shard_size, MS_SYNC);
+#endif
+			}
+		}
+	}
+
+private:
+	struct mapped_file
+	{
+		void* address = nullptr;
+		bool writable = false;
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#else
+		int file = -1;
+#endif
+	};
+
+	static size_t file_size(const std::string& path)
+	{
+#if defined(_WIN32)
+		WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+		if(!::GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+		{
+			throw std::runtime_error("couldn't open shard file");
+		}
+		return static_cast<size_t>((static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow);
+#else
+		struct stat status = {};
+		if(::stat(path.c_str(), &status) != 0)
+		{
+			throw std::runtime_error("couldn't open shard file");
+		}
+		return static_cast<size_t>(status.st_size);
+#endif
+	}
+
+	// every pass over the shards is front to back, so the OS is told to read ahead aggressively and drop pages behind.
+	void map(mapped_file& file, const std::string& path, bool present)
+	{
+		file.writable = !present;
+#if defined(_WIN32)
+		file.file = ::CreateFileA(path.c_str(), present ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, present ? OPEN_EXISTING : CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if(file.file == INVALID_HANDLE_VALUE)
+		{
+			throw std::runtime_error("couldn't open shard file");
+		}
+		const uint64_t size = static_cast<uint64_t>(shard_size);
+		file.mapping = ::CreateFileMappingA(file.file, nullptr, present ? PAGE_READONLY : PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+		if(file.mapping == nullptr)
+		{
+			throw std::runtime_error("couldn't map shard file");
+		}
+		file.address = ::MapViewOfFile(file.mapping, present ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, shard_size);
+		if(file.address == nullptr)
+		{
+			throw std::runtime_error("couldn't map shard file");
+		}
+#else
+		file.file = ::open(path.c_str(), present ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(file.file == -1)
+		{
+			throw std::runtime_error("couldn't open shard file");
+		}
+		if(!present && ::ftruncate(file.file, static_cast<off_t>(shard_size)) != 0)
+		{
+			throw std::runtime_error("couldn't size shard file");
+		}
+		if(present && file_size(path) < shard_size)
+		{
+			throw std::runtime_error("shard file too short");
+		}
+		void* address = ::mmap(nullptr, shard_size, present ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, file.file, 0);
+		if(address == MAP_FAILED)
+		{
+			throw std::runtime_error("couldn't map shard file");
+		}
+		file.address = address;
+		::madvise(file.address, shard_size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	void unmap_all()
+	{
+		for(mapped_file& file : files)
+		{
+#if defined(_WIN32)
+			if(file.address)
+			{
+				::UnmapViewOfFile(file.address);
+			}
+			if(file.mapping)
+			{
+				::CloseHandle(file.mapping);
+			}
+			if(file.file != INVALID_HANDLE_VALUE)
+			{
+				::CloseHandle(file.file);
+			}
+#else
+			if(file.address)
+			{
+				::munmap(file.address, shard_size);
+			}
+			if(file.file != -1)
+			{
+				::close(file.file);
+			}
+#endif
+			file = mapped_file();
+		}
+	}
+
+	size_t shard_size;
+	std::vector<mapped_file> files;
+	std::unique_ptr<uint8_t*[]> shards;
+};
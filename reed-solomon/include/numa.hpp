@@ -0,0 +1,367 @@
+// NUMA-aware encoding. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// the processors of each NUMA node, discovered from the OS. Machines without NUMA, or where discovery fails, look like one node.
+struct numa_topology
+{
+#if defined(_WIN32)
+	typedef GROUP_AFFINITY affinity_t;
+#else
+	typedef cpu_set_t affinity_t;
+#endif
+
+	static numa_topology detect()
+	{
+		numa_topology topology;
+#if defined(_WIN32)
+		ULONG highest_node = 0;
+		if(::GetNumaHighestNodeNumber(&highest_node))
+		{
+			for(USHORT node = 0; node <= highest_node; ++node)
+			{
+				GROUP_AFFINITY affinity = {};
+				if(::GetNumaNodeProcessorMaskEx(node, &affinity) && affinity.Mask != 0)
+				{
+					topology.nodes.push_back(affinity);
+				}
+			}
+		}
+		DWORD_PTR system_mask = 0;
+		::GetProcessAffinityMask(::GetCurrentProcess(), &topology.process_affinity, &system_mask);
+#else
+		// node numbers needn't be contiguous, so list whichever nodes there are rather than counting up until one is missing.
+		std::vector<int> node_numbers;
+		if(DIR* directory = ::opendir("/sys/devices/system/node"))
+		{
+			while(const dirent* entry = ::readdir(directory))
+			{
+				const std::string name = entry->d_name;
+				if(name.size() > 4 && name.compare(0, 4, "node") == 0 && name.find_first_not_of("0123456789", 4) == std::string::npos)
+				{
+					node_numbers.push_back(std::atoi(name.c_str() + 4));
+				}
+			}
+			::closedir(directory);
+		}
+		std::sort(node_numbers.begin(), node_numbers.end());
+		for(int node : node_numbers)
+		{
+			std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if(!cpulist)
+			{
+				continue;
+			}
+			// e.g. "0-15,32-47"
+			cpu_set_t affinity;
+			CPU_ZERO(&affinity);
+			std::string range;
+			while(std::getline(cpulist, range, ','))
+			{
+				std::istringstream parser(range);
+				int first = 0;
+				int last = 0;
+				char dash = 0;
+				if(!(parser >> first))
+				{
+					continue;
+				}
+				last = (parser >> dash >> last) ? last : first;
+				for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+				{
+					CPU_SET(cpu, &affinity);
+				}
+			}
+			if(CPU_COUNT(&affinity) != 0)
+			{
+				topology.nodes.push_back(affinity);
+			}
+		}
+		::sched_getaffinity(0, sizeof(topology.process_affinity), &topology.process_affinity);
+#endif
+		return topology;
+	}
+
+	size_t get_node_count() const
+	{
+		return nodes.empty() ? 1 : nodes.size();
+	}
+
+	int get_processor_count(size_t node) const
+	{
+		if(nodes.empty())
+		{
+			return tbb::task_scheduler_init::default_num_threads();
+		}
+#if defined(_WIN32)
+		int count = 0;
+		for(KAFFINITY mask = nodes[node].Mask; mask != 0; mask &= mask - 1)
+		{
+			++count;
+		}
+		return count;
+#else
+		return CPU_COUNT(&nodes[node]);
+#endif
+	}
+
+	// binds the calling thread to the processors of the node.
+	void pin_current_thread(size_t node) const
+	{
+		if(nodes.empty())
+		{
+			return;
+		}
+#if defined(_WIN32)
+		::SetThreadGroupAffinity(::GetCurrentThread(), &nodes[node], nullptr);
+#else
+		::pthread_setaffinity_np(::pthread_self(), sizeof(nodes[node]), &nodes[node]);
+#endif
+	}
+
+	// lets the calling thread run anywhere the process may.
+	void unpin_current_thread() const
+	{
+		if(nodes.empty())
+		{
+			return;
+		}
+#if defined(_WIN32)
+		::SetThreadAffinityMask(::GetCurrentThread(), process_affinity);
+#else
+		::pthread_setaffinity_np(::pthread_self(), sizeof(process_affinity), &process_affinity);
+#endif
+	}
+
+private:
+	std::vector<affinity_t> nodes;
+#if defined(_WIN32)
+	DWORD_PTR process_affinity;
+#else
+	cpu_set_t process_affinity;
+#endif
+};
+
+// an encoder that splits every shard into one contiguous segment per NUMA node. Each segment's pages are first touched by,
+// and later encoded, verified and repaired by, threads pinned to that node, so no chunk crosses the socket interconnect.
+// Buffers must be allocated by the numa_encoder for their pages to be placed. Buffers are page-aligned, and segments start on
+// page boundaries within each shard, so when the shard size is a whole number of pages no page is shared between two nodes.
+// Buffers sized from an object always are; buffers sized from a shard size are only if the caller's shard size is.
+struct numa_encoder
+{
+	numa_encoder(uint8_t data_shard_count_, uint8_t parity_shard_count_, numa_topology topology_ = numa_topology::detect()) : e{ data_shard_count_, parity_shard_count_ },
+	                                                                                                                       topology(std::move(topology_))
+	{
+		for(size_t node = 0; node < topology.get_node_count(); ++node)
+		{
+			// no slots are reserved for masters, so the calling thread never joins a node's arena; all of the work lands on pinned workers.
+			arenas.emplace_back(new tbb::task_arena(topology.get_processor_count(node), 0));
+			observers.emplace_back(new pinning_observer(*arenas.back(), topology, node));
+		}
+	}
+
+	~numa_encoder()
+	{
+		for(std::unique_ptr<pinning_observer>& observer : observers)
+		{
+			observer->observe(false);
+		}
+	}
+
+	size_t get_node_count() const
+	{
+		return topology.get_node_count();
+	}
+
+	const encoder& get_encoder() const
+	{
+		return e;
+	}
+
+	encoder::buffer allocate_buffers_from_object_size(const size_t object_size, const size_t minimum_padding) const
+	{
+		const size_t padding_size = encoder::padding_size_for(minimum_padding);
+		const size_t shard_size   = (padding_size + e.shard_size_for_object(object_size) + page_size - 1) & ~(page_size - 1);
+		return place(encoder::buffer{ shard_size * e.get_shard_count(), shard_size, e.get_shard_count(), padding_size, false, page_size });
+	}
+
+	encoder::buffer allocate_buffers_from_shard_size(const size_t shard_size, const size_t minimum_padding) const
+	{
+		const size_t padding_size = encoder::padding_size_for(minimum_padding);
+		return place(encoder::buffer{ shard_size * e.get_shard_count(), shard_size, e.get_shard_count(), padding_size, false, page_size });
+	}
+
+	void encode(encoder::buffer& b) const
+	{
+		for_each_segment(b, [&](size_t, size_t begin, size_t end)
+		{
+			e.rs.encode_parity(b.shards.get(), begin, end - begin, reed_solomon::execution_policy::parallel);
+		});
+	}
+
+	bool verify(encoder::buffer& b) const
+	{
+		// a mismatch on any node abandons the other nodes' verification too.
+		tbb::task_group_context mismatch;
+		for_each_segment(b, [&](size_t, size_t begin, size_t end)
+		{
+			if(!e.rs.is_parity_correct(const_cast<const uint8_t**>(b.shards.get()), begin, end - begin, &mismatch, reed_solomon::execution_policy::parallel))
+			{
+				mismatch.cancel_group_execution();
+			}
+		});
+		return !mismatch.is_group_execution_cancelled();
+	}
+
+	bool repair(encoder::buffer& b, bool* present) const
+	{
+		tbb::atomic<bool> repaired;
+		repaired = true;
+		for_each_segment(b, [&](size_t, size_t begin, size_t end)
+		{
+			if(!e.rs.decode_missing(b.shards.get(), present, begin, end - begin, reed_solomon::execution_policy::parallel))
+			{
+				repaired = false;
+			}
+		});
+		return repaired;
+	}
+
+private:
+	// segments start on page boundaries, relative to the start of each shard.
+	static constexpr size_t page_size = 4096;
+
+	struct pinning_observer : tbb::task_scheduler_observer
+	{
+		pinning_observer(tbb::task_arena& arena, numa_topology topology_, size_t node_) : tbb::task_scheduler_observer(arena),
+		                                                                                          topology(topology_),
+		                                                                                          node(node_)
+		{
+			observe(true);
+		}
+
+		virtual void on_scheduler_entry(bool)
+		{
+			topology.pin_current_thread(node);
+		}
+
+		virtual void on_scheduler_exit(bool)
+		{
+			topology.unpin_current_thread();
+		}
+
+		const numa_topology topology;
+		const size_t node;
+	};
+
+	// the byte range [begin, end) of every shard whose pages belong to node. The padding at the start of each shard goes with node 0.
+	void segment_bounds(const encoder::buffer& b, size_t node, size_t& begin, size_t& end) const
+	{
+		auto boundary = [&](size_t n)
+		{
+			return std::min(b.shard_size, ((b.shard_size * n / get_node_count()) + page_size - 1) & ~(page_size - 1));
+		};
+		begin = boundary(node);
+		end   = node + 1 == get_node_count() ? b.shard_size : boundary(node + 1);
+	}
+
+	// runs fun(node) in each node's arena at once, and waits for them all. If any of them throws, the first exception is
+	// rethrown once every node has finished.
+	template <typename F>
+	void for_each_node(F&& fun) const
+	{
+		std::mutex lock;
+		std::condition_variable finished;
+		size_t remaining = get_node_count();
+		std::exception_ptr failure;
+		for(size_t node = 0; node < get_node_count(); ++node)
+		{
+			arenas[node]->enqueue([&, node]
+			{
+				std::exception_ptr thrown;
+				try
+				{
+					fun(node);
+				}
+				catch(...)
+				{
+					thrown = std::current_exception();
+				}
+				std::lock_guard<std::mutex> guard(lock);
+				if(thrown && !failure)
+				{
+					failure = thrown;
+				}
+				if(--remaining == 0)
+				{
+					finished.notify_one();
+				}
+			});
+		}
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			finished.wait(guard, [&] { return remaining == 0; });
+		}
+		if(failure)
+		{
+			std::rethrow_exception(failure);
+		}
+	}
+
+	// runs fun(node, begin, end) over the part of each node's segment that holds shard data.
+	template <typename F>
+	void for_each_segment(const encoder::buffer& b, F&& fun) const
+	{
+		for_each_node([&](size_t node)
+		{
+			size_t begin = 0;
+			size_t end = 0;
+			segment_bounds(b, node, begin, end);
+			begin = std::max(begin, b.padding_size);
+			if(begin < end)
+			{
+				fun(node, begin, end);
+			}
+		});
+	}
+
+	encoder::buffer place(encoder::buffer&& b) const
+	{
+		for_each_node([&](size_t node)
+		{
+			size_t begin = 0;
+			size_t end = 0;
+			segment_bounds(b, node, begin, end);
+			tbb::parallel_for(static_cast<size_t>(0), b.shard_count, [&](size_t shard)
+			{
+				std::memset(b.shards[shard] + begin, 0, end - begin);
+			});
+		});
+		return std::move(b);
+	}
+
+	encoder e;
+	numa_topology topology;
+	std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+	std::vector<std::unique_ptr<pinning_observer>> observers;
+};
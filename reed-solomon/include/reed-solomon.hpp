@@ -2,13 +2,20 @@
 
 #pragma once
 
+#include "crc32c.hpp"
 #include "galois.hpp"
 #include "matrix.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <stdexcept>
+#include <vector>
 
 #define NOMINMAX
+// needed for task_scheduler_observers attached to a particular task_arena
+#define TBB_PREVIEW_LOCAL_OBSERVER 1
 
 #include <tbb/tbb.h>
 
@@ -23,22 +30,20 @@ struct reed_solomon
 {
 	static constexpr size_t alignment = 64;
 	static constexpr size_t stepsize = 16;
+	// the shard slices touched by one chunk should stay resident in a core's private cache while the chunk is processed.
+	static constexpr size_t default_cache_budget = 256 * 1024;
+	// stripes (inputs plus outputs) smaller than this are coded on the calling thread; task scheduling would cost more than it saves.
+	static constexpr size_t default_serial_threshold = 256 * 1024;
 
-	reed_solomon(uint8_t dsc, uint8_t psc) : data_shard_count(dsc),
-	                                         parity_shard_count(psc),
-	                                         total_shard_count(dsc + psc),
-	                                         m(build_matrix(dsc, dsc + psc)),
-	                                         parity_rows(new const uint8_t*[psc])
+	enum class execution_policy
 	{
-		if(static_cast<size_t>(data_shard_count) + static_cast<size_t>(parity_shard_count) > 255)
-		{
-			throw std::out_of_range("too many shards");
-		}
+		automatic, // serial below the serial threshold, parallel above it
+		parallel,  // always split the work between TBB threads
+		serial     // always run inline on the calling thread, without touching the TBB scheduler
+	};
 
-		for(size_t i = 0; i < parity_shard_count; ++i)
-		{
-			parity_rows[i] = m.get_row(data_shard_count + i);
-		}
+	reed_solomon(uint8_t dsc, uint8_t psc) : reed_solomon(dsc, psc, build_matrix(dsc, dsc + psc))
+	{
 	}
 
 	~reed_solomon()
@@ -61,23 +66,494 @@ struct reed_solomon
 		return total_shard_count;
 	}
 
-	void encode_parity(uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size) const
+	size_t get_cache_budget() const
+	{
+		return cache_budget;
+	}
+
+	// bytes of cache each chunk of work may occupy; set this to the L1 or L2 size of the target part.
+	void set_cache_budget(size_t budget)
+	{
+		cache_budget = budget;
+	}
+
+	// runs this codec's parallel work inside the given arena rather than the caller's, so a large encode can't take every core.
+	// The arena must outlive the codec, or be replaced first. nullptr goes back to the caller's arena. TBB 4.3 can't report an
+	// arena's concurrency, so pass the max_concurrency it was made with, which chunks are sized for.
+	void set_arena(tbb::task_arena* a, int max_concurrency = tbb::task_arena::automatic)
+	{
+		owned_arena.reset();
+		arena = a;
+		thread_count = static_cast<size_t>(a != nullptr && max_concurrency != tbb::task_arena::automatic ? max_concurrency : tbb::task_scheduler_init::default_num_threads());
+	}
+
+	// runs this codec's parallel work in a private arena of at most max_concurrency threads.
+	void set_max_concurrency(int max_concurrency)
+	{
+		owned_arena.reset(new tbb::task_arena(max_concurrency));
+		arena = owned_arena.get();
+		thread_count = static_cast<size_t>(max_concurrency == tbb::task_arena::automatic ? tbb::task_scheduler_init::default_num_threads() : max_concurrency);
+	}
+
+	// when the codec is called from inside the caller's own parallel work, a thread waiting for the codec's chunks can otherwise
+	// pick up unrelated outer tasks and nest them beneath the call. TBB 4.3 has no this_task_arena::isolate, so isolation is
+	// provided by running in a dedicated arena, whose threads only take that arena's tasks while they wait.
+	void set_isolation(bool isolate)
+	{
+		if(isolate && !arena)
+		{
+			set_max_concurrency(tbb::task_arena::automatic);
+		}
+		else if(!isolate && arena == owned_arena.get())
+		{
+			set_arena(nullptr);
+		}
+	}
+
+	// runs fun on a TBB worker, in the codec's arena when one has been set, and returns without waiting for it.
+	// fun must not throw.
+	template <typename F>
+	void enqueue(F fun) const
+	{
+		if(arena)
+		{
+			arena->enqueue(std::move(fun));
+		}
+		else
+		{
+			tbb::task::enqueue(*new(tbb::task::allocate_root()) enqueued_task<F>(std::move(fun)));
+		}
+	}
+
+	size_t get_serial_threshold() const
+	{
+		return serial_threshold;
+	}
+
+	void set_serial_threshold(size_t threshold)
+	{
+		serial_threshold = threshold;
+	}
+
+	// times serial and parallel encodes of doubling shard sizes, and sets the serial threshold to the smallest stripe for which
+	// parallel encoding wins. Takes a few tens of milliseconds.
+	size_t autotune_serial_threshold()
+	{
+		static constexpr size_t smallest_shard = 1024;
+		static constexpr size_t largest_shard  = 1024 * 1024;
+		static constexpr size_t repetitions    = 16;
+
+		std::unique_ptr<uint8_t[]> data{ new uint8_t[total_shard_count * largest_shard] };
+		std::memset(data.get(), 0x5a, total_shard_count * largest_shard);
+		std::unique_ptr<uint8_t*[]> shards{ new uint8_t*[total_shard_count] };
+		for(size_t i = 0; i < total_shard_count; ++i)
+		{
+			shards[i] = &data[i * largest_shard];
+		}
+
+		auto fastest = [&](size_t shard_size, execution_policy policy)
+		{
+			std::chrono::nanoseconds best = std::chrono::nanoseconds::max();
+			for(size_t i = 0; i < repetitions; ++i)
+			{
+				auto start = std::chrono::high_resolution_clock::now();
+				encode_parity(shards.get(), 0, shard_size, policy);
+				auto end = std::chrono::high_resolution_clock::now();
+				best = std::min(best, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start));
+			}
+			return best;
+		};
+
+		size_t shard_size = smallest_shard;
+		for(; shard_size <= largest_shard; shard_size *= 2)
+		{
+			if(fastest(shard_size, execution_policy::parallel) < fastest(shard_size, execution_policy::serial))
+			{
+				break;
+			}
+		}
+		serial_threshold = shard_size * total_shard_count;
+		return serial_threshold;
+	}
+
+	void encode_parity(uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size, execution_policy policy = execution_policy::automatic) const
 	{
 		// shards[0               ] through shards[data_shard_count                      - 1] contain the file data
 		// shards[data_shard_count] through shards[data_shard_count + parity_shard_count - 1] are where parity data should be written to
 		const uint8_t**      inputs  = const_cast<const uint8_t**>(&shards[0]);
 		uint8_t* __restrict* outputs =                             &shards[data_shard_count];
-		code_some_shards(parity_rows, inputs, data_shard_count, outputs, parity_shard_count, offset, shard_size);
+		code_some_shards(parity_rows, inputs, data_shard_count, outputs, parity_shard_count, offset, shard_size, policy);
+	}
+
+	static constexpr size_t default_checksum_block_size = 4096;
+
+	// encodes, and computes the CRC-32C of bytes [offset, offset + shard_size) of every shard in the same pass, while each
+	// chunk is still in cache, so that checksumming doesn't cost a second trip through memory. shard_checksums needs
+	// total_shard_count entries. If block_checksums is given, it receives the CRC-32C of every block_size bytes of each shard
+	// as well, shard after shard, the last block of each shard being short when block_size doesn't divide shard_size.
+	void encode_parity_with_checksums(uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size, uint32_t* shard_checksums, uint32_t* block_checksums = nullptr, size_t block_size = default_checksum_block_size, execution_policy policy = execution_policy::automatic) const
+	{
+		const uint8_t**      inputs  = const_cast<const uint8_t**>(&shards[0]);
+		uint8_t* __restrict* outputs =                             &shards[data_shard_count];
+		// each chunk has to be made of whole blocks.
+		chunk_plan plan = plan_chunks(data_shard_count, parity_shard_count, shard_size);
+		plan.chunk_size  = ((plan.chunk_size + block_size - 1) / block_size) * block_size;
+		plan.chunk_count = (shard_size + plan.chunk_size - 1) / plan.chunk_size;
+		const size_t block_count = (shard_size + block_size - 1) / block_size;
+		std::vector<uint32_t> own_block_checksums;
+		if(!block_checksums)
+		{
+			own_block_checksums.resize(total_shard_count * block_count);
+			block_checksums = own_block_checksums.data();
+		}
+		auto checksum_blocks = [&](size_t first_shard, size_t last_shard, size_t chunk)
+		{
+			const size_t first_block = (chunk * plan.chunk_size) / block_size;
+			const size_t last_block  = std::min(first_block + (plan.chunk_size / block_size), block_count);
+			for(size_t shard = first_shard; shard != last_shard; ++shard)
+			{
+				for(size_t block = first_block; block != last_block; ++block)
+				{
+					const size_t start = block * block_size;
+					block_checksums[(shard * block_count) + block] = crc32c::compute(0, shards[shard] + offset + start, std::min(block_size, shard_size - start));
+				}
+			}
+		};
+		// when outputs are spread across tasks, each task checksums its share of the inputs too.
+		auto code_chunk_and_checksum = [&](size_t first_output, size_t last_output, size_t chunk)
+		{
+			code_chunk(plan, parity_rows, inputs, data_shard_count, outputs, first_output, last_output, offset, shard_size, chunk);
+			const size_t output_count = std::max<size_t>(parity_shard_count, 1);
+			checksum_blocks((first_output * data_shard_count) / output_count, (std::max<size_t>(last_output, 1) * data_shard_count) / output_count, chunk);
+			checksum_blocks(data_shard_count + first_output, data_shard_count + last_output, chunk);
+		};
+		// with no parity there's no output dimension to split, but the data shards still need their checksums.
+		if(parity_shard_count == 0 || runs_serially(policy, data_shard_count, parity_shard_count, shard_size))
+		{
+			for(size_t chunk = 0; chunk < plan.chunk_count; ++chunk)
+			{
+				code_chunk_and_checksum(0, parity_shard_count, chunk);
+			}
+		}
+		else
+		{
+			arena_parallel_for(plan.work_range(parity_shard_count), [&](const tbb::blocked_range2d<size_t>& range)
+			{
+				for(size_t chunk = range.cols().begin(); chunk != range.cols().end(); ++chunk)
+				{
+					code_chunk_and_checksum(range.rows().begin(), range.rows().end(), chunk);
+				}
+			});
+		}
+
+		const crc32c::shift_t block_shift = crc32c::shift_for(block_size);
+		const crc32c::shift_t last_shift  = crc32c::shift_for(shard_size - ((block_count != 0 ? block_count - 1 : 0) * block_size));
+		for(size_t shard = 0; shard < total_shard_count; ++shard)
+		{
+			uint32_t crc = block_count != 0 ? block_checksums[shard * block_count] : 0;
+			for(size_t block = 1; block < block_count; ++block)
+			{
+				crc = crc32c::combine(crc, block_checksums[(shard * block_count) + block], block + 1 == block_count ? last_shift : block_shift);
+			}
+			shard_checksums[shard] = crc;
+		}
+	}
+
+	// one piece of a shard that isn't held in a single block of memory, such as a network receive buffer.
+	struct segment
+	{
+		const uint8_t* data;
+		size_t length;
+	};
+
+	// a shard made of segments laid end to end.
+	struct shard_view
+	{
+		const segment* segments;
+		size_t segment_count;
+	};
+
+	// encodes straight from data shards that are each a chain of segments, so they needn't be copied into one block first.
+	// Segments may be any length and alignment. parity_shards[0] through parity_shards[parity_shard_count - 1] are contiguous.
+	void encode_parity(const shard_view* data_shards, uint8_t* __restrict* __restrict parity_shards, size_t offset, size_t shard_size, execution_policy policy = execution_policy::automatic) const
+	{
+		const segmented_inputs inputs{ data_shards, data_shard_count, offset + shard_size };
+		code_some_shards(parity_rows, inputs, data_shard_count, parity_shards, parity_shard_count, offset, shard_size, policy);
 	}
 
-	bool is_parity_correct(const uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size) const
+	// applies an overwrite of bytes [offset, offset + byte_count) of one data shard to the parity, without reading any other
+	// data shard. old_data and new_data hold the bytes before and after the overwrite. Since parity is linear, adding in the
+	// shard's contribution of old ^ new is enough, and only the matching range of each parity shard is touched.
+	void update_parity(uint8_t data_shard, size_t offset, const uint8_t* old_data, const uint8_t* new_data, size_t byte_count, uint8_t* __restrict* __restrict parity_shards, execution_policy policy = execution_policy::automatic) const
+	{
+		if(data_shard >= data_shard_count)
+		{
+			throw std::out_of_range("no such data shard");
+		}
+		if(parity_shard_count == 0)
+		{
+			return;
+		}
+		const chunk_plan plan = plan_chunks(2, parity_shard_count, byte_count);
+		// the delta is built a tile at a time on the stack and applied to every parity shard while it's still in L1, so there's
+		// no allocation and no extra pass over memory. Each tile is placed to share the parity's alignment, which keeps
+		// do_multiply_xor on its aligned path.
+		auto update_chunk = [&](size_t first_output, size_t last_output, size_t chunk)
+		{
+			uint8_t tile[4096 + alignment];
+			const size_t end = std::min(chunk * plan.chunk_size + plan.chunk_size, byte_count);
+			for(size_t start = chunk * plan.chunk_size; start < end; start += 4096)
+			{
+				const size_t length  = std::min<size_t>(4096, end - start);
+				const size_t skew    = (reinterpret_cast<size_t>(parity_shards[first_output] + offset + start) - reinterpret_cast<size_t>(tile)) & (alignment - 1);
+				uint8_t* const delta = tile + skew;
+				for(size_t i = 0; i < length; ++i)
+				{
+					delta[i] = old_data[start + i] ^ new_data[start + i];
+				}
+				for(size_t output_shard = first_output; output_shard != last_output; ++output_shard)
+				{
+					do_multiply_xor(parity_rows[output_shard][data_shard], delta, parity_shards[output_shard] + offset + start, 0, length);
+				}
+			}
+		};
+		if(runs_serially(policy, 2, parity_shard_count, byte_count))
+		{
+			for(size_t chunk = 0; chunk < plan.chunk_count; ++chunk)
+			{
+				update_chunk(0, parity_shard_count, chunk);
+			}
+			return;
+		}
+		arena_parallel_for(plan.work_range(parity_shard_count), [&](const tbb::blocked_range2d<size_t>& range)
+		{
+			for(size_t chunk = range.cols().begin(); chunk != range.cols().end(); ++chunk)
+			{
+				update_chunk(range.rows().begin(), range.rows().end(), chunk);
+			}
+		});
+	}
+
+	// adds the contribution of bytes [offset, offset + byte_count) of one data shard into the parity. data points at the first
+	// of those bytes. Parity is linear in the data, so starting from zeroed parity shards, a stripe's parity can be built up
+	// piece by piece as the data arrives.
+	void add_to_parity(uint8_t data_shard, const uint8_t* data, uint8_t* __restrict* __restrict parity_shards, size_t offset, size_t byte_count, execution_policy policy = execution_policy::automatic) const
+	{
+		if(data_shard >= data_shard_count)
+		{
+			throw std::out_of_range("no such data shard");
+		}
+		const chunk_plan plan = plan_chunks(1, parity_shard_count, byte_count);
+		auto add_chunk = [&](size_t first_output, size_t last_output, size_t chunk)
+		{
+			const size_t start  = chunk * plan.chunk_size;
+			const size_t length = std::min(plan.chunk_size, byte_count - start);
+			for(size_t output_shard = first_output; output_shard != last_output; ++output_shard)
+			{
+				do_multiply_xor(parity_rows[output_shard][data_shard], data + start, parity_shards[output_shard] + offset + start, 0, length);
+			}
+		};
+		if(runs_serially(policy, 1, parity_shard_count, byte_count))
+		{
+			for(size_t chunk = 0; chunk < plan.chunk_count; ++chunk)
+			{
+				add_chunk(0, parity_shard_count, chunk);
+			}
+			return;
+		}
+		arena_parallel_for(plan.work_range(parity_shard_count), [&](const tbb::blocked_range2d<size_t>& range)
+		{
+			for(size_t chunk = range.cols().begin(); chunk != range.cols().end(); ++chunk)
+			{
+				add_chunk(range.rows().begin(), range.rows().end(), chunk);
+			}
+		});
+	}
+
+	bool is_parity_correct(const uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size, tbb::task_group_context* cancellation = nullptr, execution_policy policy = execution_policy::automatic) const
 	{
 		const uint8_t* __restrict* inputs   = &shards[0];
 		const uint8_t* __restrict* parities = &shards[data_shard_count];
-		return check_some_shards(parity_rows, inputs, data_shard_count, parities, parity_shard_count, offset, shard_size);
+		return check_some_shards(parity_rows, inputs, data_shard_count, parities, parity_shard_count, offset, shard_size, cancellation, policy);
 	}
 
-	bool decode_missing(uint8_t* __restrict* __restrict shards, bool* shard_present, size_t offset, size_t shard_size) const
+	static constexpr uint8_t unknown_shard = 0xff;
+
+	// a run of bytes that fails verification, attributed to the shard holding the bad data. Offsets are in the same space as
+	// the offset passed to locate_corruption, so a run can be repaired with decode_missing(shards, present, run.offset, run.length).
+	// When more than one shard is corrupt at the same position, or there's only one parity shard, the shard is unknown_shard.
+	struct corrupt_range
+	{
+		uint8_t shard;
+		size_t offset;
+		size_t length;
+	};
+
+	std::vector<corrupt_range> locate_corruption(const uint8_t* __restrict* __restrict shards, size_t offset, size_t shard_size) const
+	{
+		// a single corrupt data shard e with error E gives syndromes s[j] = parity_rows[j][e] * E. Every square submatrix of the parity rows
+		// is invertible, so no two columns are proportional, and s[1] / s[0] identifies e uniquely. A single corrupt parity shard gives
+		// exactly one non-zero syndrome.
+		std::array<uint8_t, galois_t::FIELD_SIZE> shard_by_ratio;
+		// fill takes a reference, so give it a copy rather than odr-use the static member.
+		const uint8_t unknown = unknown_shard;
+		shard_by_ratio.fill(unknown);
+		if(parity_shard_count >= 2)
+		{
+			for(uint8_t shard = 0; shard < data_shard_count; ++shard)
+			{
+				shard_by_ratio[galois.divide(parity_rows[1][shard], parity_rows[0][shard])] = shard;
+			}
+		}
+
+		const uint8_t* __restrict* datas    = &shards[0];
+		const uint8_t* __restrict* parities = &shards[data_shard_count];
+
+		const chunk_plan plan = plan_chunks(data_shard_count, parity_shard_count, shard_size);
+		tbb::combinable<std::vector<corrupt_range>> found;
+		arena_parallel_for(static_cast<size_t>(0), plan.chunk_count, [&](size_t chunk)
+		{
+			const size_t start  = offset + (chunk * plan.chunk_size);
+			const size_t length = std::min(plan.chunk_size, shard_size - (chunk * plan.chunk_size));
+			bool clean = true;
+			for(uint8_t parity_shard = 0; parity_shard < parity_shard_count && clean; ++parity_shard)
+			{
+				clean = do_multiply_compare(parity_rows[parity_shard], datas, data_shard_count, parities[parity_shard], start, length);
+			}
+			if(clean)
+			{
+				return;
+			}
+
+			std::unique_ptr<uint8_t[]> syndromes{ new uint8_t[parity_shard_count * length] };
+			for(uint8_t parity_shard = 0; parity_shard < parity_shard_count; ++parity_shard)
+			{
+				uint8_t* syndrome = &syndromes[parity_shard * length];
+				std::memcpy(syndrome, parities[parity_shard] + start, length);
+				for(uint8_t data_shard = 0; data_shard < data_shard_count; ++data_shard)
+				{
+					do_multiply_xor(parity_rows[parity_shard][data_shard], datas[data_shard] + start, syndrome, 0, length);
+				}
+			}
+
+			std::vector<corrupt_range>& ranges = found.local();
+			for(size_t i = 0; i < length; ++i)
+			{
+				uint8_t nonzero_count = 0;
+				uint8_t last_nonzero = 0;
+				for(uint8_t parity_shard = 0; parity_shard < parity_shard_count; ++parity_shard)
+				{
+					if(syndromes[(parity_shard * length) + i] != 0)
+					{
+						++nonzero_count;
+						last_nonzero = parity_shard;
+					}
+				}
+				if(nonzero_count == 0)
+				{
+					continue;
+				}
+
+				uint8_t shard = unknown_shard;
+				if(parity_shard_count >= 2 && nonzero_count == 1)
+				{
+					shard = data_shard_count + last_nonzero;
+				}
+				else if(nonzero_count == parity_shard_count && parity_shard_count >= 2)
+				{
+					const uint8_t candidate = shard_by_ratio[galois.divide(syndromes[length + i], syndromes[i])];
+					if(candidate != unknown_shard)
+					{
+						const uint8_t error = galois.divide(syndromes[i], parity_rows[0][candidate]);
+						bool consistent = true;
+						for(uint8_t parity_shard = 2; parity_shard < parity_shard_count && consistent; ++parity_shard)
+						{
+							consistent = syndromes[(parity_shard * length) + i] == galois.multiply(parity_rows[parity_shard][candidate], error);
+						}
+						if(consistent)
+						{
+							shard = candidate;
+						}
+					}
+				}
+
+				if(!ranges.empty() && ranges.back().shard == shard && ranges.back().offset + ranges.back().length == start + i)
+				{
+					++ranges.back().length;
+				}
+				else
+				{
+					ranges.push_back(corrupt_range{ shard, start + i, 1 });
+				}
+			}
+		});
+
+		std::vector<corrupt_range> result;
+		found.combine_each([&](const std::vector<corrupt_range>& ranges)
+		{
+			result.insert(result.end(), ranges.begin(), ranges.end());
+		});
+		std::sort(result.begin(), result.end(), [](const corrupt_range& lhs, const corrupt_range& rhs)
+		{
+			return lhs.offset < rhs.offset;
+		});
+		// runs that straddle chunk boundaries were found by different tasks, so stitch them back together.
+		std::vector<corrupt_range> merged;
+		for(const corrupt_range& range : result)
+		{
+			if(!merged.empty() && merged.back().shard == range.shard && merged.back().offset + merged.back().length == range.offset)
+			{
+				merged.back().length += range.length;
+			}
+			else
+			{
+				merged.push_back(range);
+			}
+		}
+		return merged;
+	}
+
+	// the data_shard_count present shards that decoding reads: the earliest whose rows of the coding matrix are independent,
+	// which for build_matrix's matrix are simply the first present ones. Returns false if the present shards' rows don't have
+	// full rank, so the missing shards can't be rebuilt.
+	bool choose_decoding_shards(const bool* shard_present, uint8_t* chosen) const
+	{
+		// each row taken is reduced against those taken before it, leaving a 1 in a column where every later row has a 0.
+		matrix reduced{ data_shard_count, data_shard_count };
+		std::vector<size_t> pivots;
+		std::vector<uint8_t> row(data_shard_count);
+		for(size_t shard = 0; shard < total_shard_count && pivots.size() < data_shard_count; ++shard)
+		{
+			if(!shard_present[shard])
+			{
+				continue;
+			}
+			std::copy(m.get_row(shard), m.get_row(shard) + data_shard_count, row.begin());
+			for(size_t r = 0; r < pivots.size(); ++r)
+			{
+				const uint8_t scale = row[pivots[r]];
+				for(size_t c = 0; c < data_shard_count && scale != 0; ++c)
+				{
+					row[c] ^= galois.multiply(reduced.get(r, c), scale);
+				}
+			}
+			const size_t pivot = static_cast<size_t>(std::find_if(row.begin(), row.end(), [](uint8_t v) { return v != 0; }) - row.begin());
+			if(pivot == data_shard_count)
+			{
+				continue;
+			}
+			const uint8_t inverse = galois.divide(1, row[pivot]);
+			for(size_t c = 0; c < data_shard_count; ++c)
+			{
+				reduced.set(pivots.size(), c, galois.multiply(row[c], inverse));
+			}
+			chosen[pivots.size()] = static_cast<uint8_t>(shard);
+			pivots.push_back(pivot);
+		}
+		return pivots.size() == data_shard_count;
+	}
+
+	bool decode_missing(uint8_t* __restrict* __restrict shards, bool* shard_present, size_t offset, size_t shard_size, execution_policy policy = execution_policy::automatic) const
 	{
 		size_t number_present = 0;
 		for(size_t i = 0; i < total_shard_count; ++i)
@@ -91,58 +567,373 @@ struct reed_solomon
 		{
 			return true;
 		}
-		if(number_present < data_shard_count)
+		std::unique_ptr<uint8_t[]> chosen{ new uint8_t[data_shard_count] };
+		if(number_present < data_shard_count || !choose_decoding_shards(shard_present, chosen.get()))
 		{
 			return false;
 		}
 
-		matrix sub_matrix{ data_shard_count, data_shard_count };
-		std::unique_ptr<const uint8_t*[]> sub_shards{ new const uint8_t*[data_shard_count] };
+		decoder d = build_decoder(shards, shard_present, chosen.get());
+		code_some_shards(d.data_rows.get(), d.sub_shards.get(), data_shard_count, d.data_outputs.get(), d.data_output_count, offset, shard_size, policy);
+		code_some_shards(d.parity_rows.get(), const_cast<const uint8_t**>(shards), data_shard_count, d.parity_outputs.get(), d.parity_output_count, offset, shard_size, policy);
+		return true;
+	}
+
+	// one of many independent stripes handled by a single call. shard_present is only used by decode_batch.
+	struct stripe
+	{
+		uint8_t** shards;
+		size_t offset;
+		size_t shard_size;
+		bool* shard_present;
+	};
+
+	// the batch functions schedule every chunk of every stripe as one pool of work, rather than running a parallel loop per stripe,
+	// so that many small stripes can still occupy every thread. Results are identical to calling the per-stripe functions.
+	void encode_batch(const stripe* stripes, size_t stripe_count) const
+	{
+		std::vector<coding_job> jobs;
+		jobs.reserve(stripe_count);
+		for(size_t i = 0; i < stripe_count; ++i)
+		{
+			jobs.push_back(coding_job{ const_cast<const uint8_t**>(parity_rows), const_cast<const uint8_t**>(stripes[i].shards), data_shard_count, &stripes[i].shards[data_shard_count], parity_shard_count, stripes[i].offset, stripes[i].shard_size });
+		}
+		code_batch(jobs.data(), jobs.size());
+	}
+
+	void verify_batch(const stripe* stripes, size_t stripe_count, bool* results) const
+	{
+		std::vector<coding_job> jobs;
+		jobs.reserve(stripe_count);
+		for(size_t i = 0; i < stripe_count; ++i)
+		{
+			jobs.push_back(coding_job{ const_cast<const uint8_t**>(parity_rows), const_cast<const uint8_t**>(stripes[i].shards), data_shard_count, &stripes[i].shards[data_shard_count], parity_shard_count, stripes[i].offset, stripes[i].shard_size });
+		}
+		std::unique_ptr<tbb::atomic<bool>[]> mismatched{ new tbb::atomic<bool>[stripe_count] };
+		for(size_t i = 0; i < stripe_count; ++i)
+		{
+			mismatched[i] = false;
+		}
+		for_each_batch_chunk(jobs.data(), jobs.size(), [&](size_t job, const chunk_plan& plan, size_t chunk)
 		{
-			size_t sub_matrix_row = 0;
-			for(size_t matrix_row = 0; matrix_row < total_shard_count && sub_matrix_row < data_shard_count; ++matrix_row)
+			if(mismatched[job])
 			{
-				if(shard_present[matrix_row])
+				return;
+			}
+			const coding_job& j = jobs[job];
+			const size_t start  = j.offset + (chunk * plan.chunk_size);
+			const size_t length = std::min(plan.chunk_size, j.byte_count - (chunk * plan.chunk_size));
+			for(uint8_t output_shard = 0; output_shard < j.output_count; ++output_shard)
+			{
+				if(!do_multiply_compare(j.matrix_rows[output_shard], j.inputs, j.input_count, j.outputs[output_shard], start, length))
 				{
-					for(size_t c = 0; c < data_shard_count; ++c)
-					{
-						sub_matrix.set(sub_matrix_row, c, m.get(matrix_row, c));
-					}
-					sub_shards[sub_matrix_row] = shards[matrix_row];
-					++sub_matrix_row;
+					mismatched[job] = true;
+					return;
+				}
+			}
+		});
+		for(size_t i = 0; i < stripe_count; ++i)
+		{
+			results[i] = !mismatched[i];
+		}
+	}
+
+	// results[i] is false if stripe i has too few shards present to be rebuilt.
+	void decode_batch(const stripe* stripes, size_t stripe_count, bool* results) const
+	{
+		std::vector<std::unique_ptr<decoder>> decoders(stripe_count);
+		arena_parallel_for(static_cast<size_t>(0), stripe_count, [&](size_t i)
+		{
+			size_t number_present = 0;
+			for(size_t shard = 0; shard < total_shard_count; ++shard)
+			{
+				if(stripes[i].shard_present[shard])
+				{
+					++number_present;
+				}
+			}
+			std::unique_ptr<uint8_t[]> chosen{ new uint8_t[data_shard_count] };
+			results[i] = number_present == total_shard_count || (number_present >= data_shard_count && choose_decoding_shards(stripes[i].shard_present, chosen.get()));
+			if(results[i] && number_present != total_shard_count)
+			{
+				decoders[i].reset(new decoder(build_decoder(stripes[i].shards, stripes[i].shard_present, chosen.get())));
+			}
+		});
+
+		// missing parity is rebuilt from the data shards, so every data shard must be complete before the second pass starts.
+		std::vector<coding_job> data_jobs;
+		std::vector<coding_job> parity_jobs;
+		for(size_t i = 0; i < stripe_count; ++i)
+		{
+			if(decoders[i])
+			{
+				const decoder& d = *decoders[i];
+				data_jobs.push_back  (coding_job{ d.data_rows.get(),   d.sub_shards.get(),                                  data_shard_count, d.data_outputs.get(),   d.data_output_count,   stripes[i].offset, stripes[i].shard_size });
+				parity_jobs.push_back(coding_job{ d.parity_rows.get(), const_cast<const uint8_t**>(stripes[i].shards), data_shard_count, d.parity_outputs.get(), d.parity_output_count, stripes[i].offset, stripes[i].shard_size });
+			}
+		}
+		code_batch(data_jobs.data(), data_jobs.size());
+		code_batch(parity_jobs.data(), parity_jobs.size());
+	}
+
+	// one bitmap per shard, one flag per block, set for each block that's lost or known to be bad.
+	typedef std::vector<std::vector<bool>> damage_map;
+
+	// rebuilds only the damaged blocks of bytes [offset, offset + shard_size) of each shard, so that one bad sector costs a
+	// block's worth of decoding rather than a whole shard's. Block b of a shard covers bytes [b * block_size, (b + 1) * block_size)
+	// after offset; the last block is short when block_size doesn't divide shard_size. Blocks are grouped by which shards are
+	// damaged in them, and each group's matrix is inverted just once. Returns false, having changed nothing, if any block is
+	// damaged in more shards than there is parity.
+	bool decode_damaged_blocks(uint8_t* __restrict* __restrict shards, const damage_map& damage, size_t offset, size_t shard_size, size_t block_size) const
+	{
+		const size_t block_count = (shard_size + block_size - 1) / block_size;
+		if(damage.size() != total_shard_count)
+		{
+			throw std::invalid_argument("one bitmap is needed for each shard");
+		}
+		for(const std::vector<bool>& bitmap : damage)
+		{
+			if(bitmap.size() < block_count)
+			{
+				throw std::invalid_argument("bitmap too short");
+			}
+		}
+
+		// runs of consecutive blocks, as [first, last), keyed by the shards damaged in them.
+		std::map<std::vector<bool>, std::vector<std::pair<size_t, size_t>>> patterns;
+		std::vector<bool> previous;
+		for(size_t block = 0; block < block_count; ++block)
+		{
+			std::vector<bool> pattern(total_shard_count);
+			size_t damaged_count = 0;
+			for(size_t shard = 0; shard < total_shard_count; ++shard)
+			{
+				pattern[shard] = damage[shard][block];
+				damaged_count += pattern[shard] ? 1 : 0;
+			}
+			if(damaged_count > parity_shard_count)
+			{
+				return false;
+			}
+			if(damaged_count != 0)
+			{
+				std::vector<std::pair<size_t, size_t>>& runs = patterns[pattern];
+				if(pattern == previous)
+				{
+					runs.back().second = block + 1;
+				}
+				else
+				{
+					runs.push_back(std::make_pair(block, block + 1));
 				}
 			}
+			previous = std::move(pattern);
+		}
+
+		// as with decode_batch, damaged data blocks are all rebuilt before any parity is.
+		std::vector<std::unique_ptr<decoder>> decoders;
+		std::vector<coding_job> data_jobs;
+		std::vector<coding_job> parity_jobs;
+		std::unique_ptr<bool[]> present{ new bool[total_shard_count] };
+		std::unique_ptr<uint8_t[]> chosen{ new uint8_t[data_shard_count] };
+		for(const auto& pattern : patterns)
+		{
+			for(size_t shard = 0; shard < total_shard_count; ++shard)
+			{
+				present[shard] = !pattern.first[shard];
+			}
+			if(!choose_decoding_shards(present.get(), chosen.get()))
+			{
+				return false;
+			}
+			decoders.emplace_back(new decoder(build_decoder(shards, present.get(), chosen.get())));
+			const decoder& d = *decoders.back();
+			for(const std::pair<size_t, size_t>& run : pattern.second)
+			{
+				const size_t start  = run.first * block_size;
+				const size_t length = std::min(run.second * block_size, shard_size) - start;
+				data_jobs.push_back  (coding_job{ d.data_rows.get(),   d.sub_shards.get(),                       data_shard_count, d.data_outputs.get(),   d.data_output_count,   offset + start, length });
+				parity_jobs.push_back(coding_job{ d.parity_rows.get(), const_cast<const uint8_t**>(shards), data_shard_count, d.parity_outputs.get(), d.parity_output_count, offset + start, length });
+			}
+		}
+		code_batch(data_jobs.data(), data_jobs.size());
+		code_batch(parity_jobs.data(), parity_jobs.size());
+		return true;
+	}
+
+private:
+	friend struct lrc;
+
+	// a code with some other systematic coding matrix: dsc + psc rows of dsc columns, the first dsc of them the identity. Only
+	// lrc uses it. Such a matrix needn't be MDS, which locate_corruption and repair_corruption depend on, so it isn't public.
+	reed_solomon(uint8_t dsc, uint8_t psc, matrix coding_matrix) : data_shard_count(dsc),
+	                                                               parity_shard_count(psc),
+	                                                               total_shard_count(dsc + psc),
+	                                                               m(std::move(coding_matrix)),
+	                                                               parity_rows(nullptr),
+	                                                               cache_budget(default_cache_budget),
+	                                                               serial_threshold(default_serial_threshold),
+	                                                               arena(nullptr),
+	                                                               thread_count(static_cast<size_t>(tbb::task_scheduler_init::default_num_threads()))
+	{
+		if(static_cast<size_t>(data_shard_count) + static_cast<size_t>(parity_shard_count) > 255)
+		{
+			throw std::out_of_range("too many shards");
+		}
+		if(m.get_rows() != total_shard_count || m.get_columns() != data_shard_count || m.submatrix(0, 0, data_shard_count, data_shard_count) != matrix::identity(data_shard_count))
+		{
+			throw std::invalid_argument("coding matrix isn't systematic");
+		}
+
+		parity_rows = new const uint8_t*[psc];
+
+		for(size_t i = 0; i < parity_shard_count; ++i)
+		{
+			parity_rows[i] = m.get_row(data_shard_count + i);
+		}
+	}
+
+	// the arguments of one code_some_shards call, so that many of them can be scheduled together.
+	struct coding_job
+	{
+		const uint8_t** matrix_rows;
+		const uint8_t** inputs;
+		uint8_t input_count;
+		uint8_t** outputs;
+		uint8_t output_count;
+		size_t offset;
+		size_t byte_count;
+	};
+
+	// the inverted matrix and shard pointers needed to rebuild one particular set of missing shards.
+	struct decoder
+	{
+		decoder(matrix&& data_decode_matrix_, uint8_t parity_shard_count) : data_decode_matrix(std::move(data_decode_matrix_)),
+		                                                                    sub_shards(new const uint8_t*[data_decode_matrix.get_rows()]),
+		                                                                    data_outputs(new uint8_t*[parity_shard_count]),
+		                                                                    data_rows(new const uint8_t*[parity_shard_count]),
+		                                                                    data_output_count(0),
+		                                                                    parity_outputs(new uint8_t*[parity_shard_count]),
+		                                                                    parity_rows(new const uint8_t*[parity_shard_count]),
+		                                                                    parity_output_count(0)
+		{
+		}
+
+		matrix data_decode_matrix;
+		std::unique_ptr<const uint8_t*[]> sub_shards;
+		std::unique_ptr<uint8_t*[]> data_outputs;
+		std::unique_ptr<const uint8_t*[]> data_rows;
+		uint8_t data_output_count;
+		std::unique_ptr<uint8_t*[]> parity_outputs;
+		std::unique_ptr<const uint8_t*[]> parity_rows;
+		uint8_t parity_output_count;
+	};
+
+	// chosen is the set of shards picked by choose_decoding_shards.
+	decoder build_decoder(uint8_t* __restrict* __restrict shards, const bool* shard_present, const uint8_t* chosen) const
+	{
+		matrix sub_matrix{ data_shard_count, data_shard_count };
+		std::unique_ptr<const uint8_t*[]> sub_shards{ new const uint8_t*[data_shard_count] };
+		for(size_t sub_matrix_row = 0; sub_matrix_row < data_shard_count; ++sub_matrix_row)
+		{
+			for(size_t c = 0; c < data_shard_count; ++c)
+			{
+				sub_matrix.set(sub_matrix_row, c, m.get(chosen[sub_matrix_row], c));
+			}
+			sub_shards[sub_matrix_row] = shards[chosen[sub_matrix_row]];
 		}
-		matrix data_decode_matrix = sub_matrix.invert();
+		decoder d{ sub_matrix.invert(), parity_shard_count };
+		std::copy(sub_shards.get(), sub_shards.get() + data_shard_count, d.sub_shards.get());
 
-		std::unique_ptr<uint8_t*[]> outputs{ new uint8_t*[parity_shard_count] };
-		std::unique_ptr<const uint8_t*[]> matrix_rows{ new const uint8_t*[parity_shard_count] };
-		uint8_t output_count = 0;
 		for(int shard = 0; shard < data_shard_count; ++shard)
 		{
 			if(!shard_present[shard])
 			{
-				outputs[output_count] = shards[shard];
-				matrix_rows[output_count] = data_decode_matrix.get_row(shard);
-				++output_count;
+				d.data_outputs[d.data_output_count] = shards[shard];
+				d.data_rows[d.data_output_count] = d.data_decode_matrix.get_row(shard);
+				++d.data_output_count;
 			}
 		}
-		code_some_shards(matrix_rows.get(), sub_shards.get(), data_shard_count, outputs.get(), output_count, offset, shard_size);
-		output_count = 0;
 		for(int shard = data_shard_count; shard < total_shard_count; shard++)
 		{
 			if(!shard_present[shard])
 			{
-				outputs[output_count] = shards[shard];
-				matrix_rows[output_count] = parity_rows[shard - data_shard_count];
-				++output_count;
+				d.parity_outputs[d.parity_output_count] = shards[shard];
+				d.parity_rows[d.parity_output_count] = parity_rows[shard - data_shard_count];
+				++d.parity_output_count;
 			}
 		}
-		code_some_shards(matrix_rows.get(), const_cast<const uint8_t**>(shards), data_shard_count, outputs.get(), output_count, offset, shard_size);
-		return true;
+		return d;
+	}
+
+	template <typename F>
+	struct enqueued_task : tbb::task
+	{
+		enqueued_task(F&& fun_) : fun(std::move(fun_))
+		{
+		}
+
+		tbb::task* execute() override
+		{
+			fun();
+			return nullptr;
+		}
+
+		F fun;
+	};
+
+	// every parallel loop goes through here, so that it runs in the codec's arena when one has been set.
+	template <typename... Args>
+	void arena_parallel_for(Args&&... args) const
+	{
+		if(arena)
+		{
+			arena->execute([&]
+			{
+				tbb::parallel_for(std::forward<Args>(args)...);
+			});
+		}
+		else
+		{
+			tbb::parallel_for(std::forward<Args>(args)...);
+		}
+	}
+
+	// calls fun(job, plan, chunk) for every chunk of every job, as a single parallel loop.
+	template <typename F>
+	void for_each_batch_chunk(const coding_job* jobs, size_t job_count, F&& fun) const
+	{
+		std::vector<chunk_plan> plans;
+		plans.reserve(job_count);
+		std::vector<size_t> first_chunks(job_count + 1, 0);
+		for(size_t job = 0; job < job_count; ++job)
+		{
+			plans.push_back(plan_chunks(jobs[job].input_count, jobs[job].output_count, jobs[job].byte_count));
+			first_chunks[job + 1] = first_chunks[job] + plans[job].chunk_count;
+		}
+		arena_parallel_for(tbb::blocked_range<size_t>(0, first_chunks.back()), [&](const tbb::blocked_range<size_t>& range)
+		{
+			size_t job = static_cast<size_t>(std::upper_bound(first_chunks.begin(), first_chunks.end(), range.begin()) - first_chunks.begin()) - 1;
+			for(size_t chunk = range.begin(); chunk != range.end(); ++chunk)
+			{
+				while(chunk >= first_chunks[job + 1])
+				{
+					++job;
+				}
+				fun(job, plans[job], chunk - first_chunks[job]);
+			}
+		});
+	}
+
+	void code_batch(const coding_job* jobs, size_t job_count) const
+	{
+		for_each_batch_chunk(jobs, job_count, [&](size_t job, const chunk_plan& plan, size_t chunk)
+		{
+			const coding_job& j = jobs[job];
+			code_chunk(plan, j.matrix_rows, j.inputs, j.input_count, j.outputs, 0, j.output_count, j.offset, j.byte_count, chunk);
+		});
 	}
 
-private:
 	template <typename F, std::size_t... Indices, typename... Args>
 	static void __forceinline unroll_aux(F&& fun, std::index_sequence<Indices...>, Args&&... args)
 	{
@@ -167,13 +958,58 @@ private:
 		}
 	}
 
+	// below this, per-task scheduling overhead outweighs the arithmetic.
+	static constexpr size_t minimum_chunk_size = 1024;
+	// chunks per thread, so that threads that finish early have something to steal.
+	static constexpr size_t chunks_per_thread  = 4;
+
+	struct chunk_plan
+	{
+		size_t chunk_size;
+		size_t chunk_count;
+		// inputs are consumed this many at a time, accumulating partial parity, so that wide stripes still fit the cache budget.
+		uint8_t input_group_size;
+		// small stripes yield too few chunks to occupy every thread, so the outputs are divided between threads as well.
+		bool spread_outputs;
+
+		// output shards by chunks. Unless spread_outputs is set, the output dimension is never split, so each task computes
+		// every output for its chunks and reads each input slice from cache after the first output.
+		tbb::blocked_range2d<size_t> work_range(uint8_t output_count) const
+		{
+			const size_t output_grainsize = spread_outputs ? 1 : std::max<size_t>(output_count, 1);
+			return tbb::blocked_range2d<size_t>(0, output_count, output_grainsize, 0, chunk_count, 1);
+		}
+	};
+
+	// picks a chunk size for each call, rather than once per process, so that differently sized calls are each split sensibly.
+	// The final chunk is short when byte_count isn't a multiple of the chunk size; there's no serial tail.
+	chunk_plan plan_chunks(uint8_t input_count, uint8_t output_count, size_t byte_count) const
+	{
+		// every input and output slice of a chunk should fit the budget together. If that would make chunks too small, keep
+		// the minimum chunk size and instead shrink the number of inputs each pass over the outputs reads.
+		size_t cache_limited = cache_budget / (static_cast<size_t>(input_count) + static_cast<size_t>(output_count));
+		uint8_t input_group_size = input_count;
+		if(cache_limited < minimum_chunk_size)
+		{
+			cache_limited = minimum_chunk_size;
+			const size_t tile_slices = cache_budget / minimum_chunk_size;
+			input_group_size = static_cast<uint8_t>(std::max<size_t>(tile_slices > output_count ? tile_slices - output_count : 0, 1));
+		}
+		const size_t balance_limited = byte_count / (thread_count * chunks_per_thread);
+		// std::max takes references, so pass it a copy rather than odr-use the static member, which has no definition.
+		const size_t minimum         = minimum_chunk_size;
+		const size_t chunk_size      = std::max(std::min(cache_limited, balance_limited), minimum) & ~(alignment - 1);
+		const size_t chunk_count     = (byte_count + chunk_size - 1) / chunk_size;
+		return chunk_plan{ chunk_size, chunk_count, input_group_size, chunk_count < thread_count * chunks_per_thread };
+	}
+
 	// http://www.snia.org/sites/default/files2/SDC2013/presentations/NewThinking/EthanMiller_Screaming_Fast_Galois_Field%20Arithmetic_SIMD%20Instructions.pdf
 	void do_multiply(uint8_t matrix_value, const uint8_t* __restrict inputs, uint8_t* __restrict outputs, size_t offset, size_t byte_count) const
 	{
 		if((reinterpret_cast<size_t>(&inputs[offset]) & (alignment - 1)) != (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1)))
 		{
 			// align on output, leave input unaligned. Rationale: make code more similar to xor case!
-			size_t head = (alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment;
+			size_t head = std::min((alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment, byte_count);
 			size_t body = (byte_count - head) & (~(alignment - 1));
 			size_t tail = byte_count - body - head;
 			for(size_t i = offset; i < offset + head; ++i)
@@ -206,7 +1042,7 @@ private:
 		}
 		else
 		{
-			size_t head = (alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment;
+			size_t head = std::min((alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment, byte_count);
 			size_t body = (byte_count - head) & (~(alignment - 1));
 			size_t tail = byte_count - body - head;
 			for(size_t i = offset; i < offset + head; ++i)
@@ -244,7 +1080,7 @@ private:
 		if((reinterpret_cast<size_t>(&inputs[offset]) & (alignment - 1)) != (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1)))
 		{
 			// align on output, leave input unaligned. Rationale: input has one load; output has one load and one store.
-			size_t head = (alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment;
+			size_t head = std::min((alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment, byte_count);
 			size_t body = (byte_count - head) & (~(alignment - 1));
 			size_t tail = byte_count - body - head;
 			for(size_t i = offset; i < offset + head; ++i)
@@ -279,7 +1115,7 @@ private:
 		}
 		else
 		{
-			size_t head = (alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment;
+			size_t head = std::min((alignment - (reinterpret_cast<size_t>(&outputs[offset]) & (alignment - 1))) % alignment, byte_count);
 			size_t body = (byte_count - head) & (~(alignment - 1));
 			size_t tail = byte_count - body - head;
 			for(size_t i = offset; i < offset + head; ++i)
@@ -315,91 +1151,242 @@ private:
 		}
 	}
 
-	void code_some_shards(const uint8_t* __restrict* __restrict matrix_rows, const uint8_t* __restrict* __restrict inputs, uint8_t input_count, uint8_t* __restrict* __restrict outputs, uint8_t output_count, size_t offset, size_t byte_count) const
+	// data shards given as segment chains. Each shard's segment start offsets are found once per call, so that each chunk can
+	// find where it begins with a binary search.
+	struct segmented_inputs
 	{
-		static const size_t chunk_size = 4096;
-		static const size_t chunks = byte_count / chunk_size;
-		tbb::parallel_for(static_cast<size_t>(0), chunks, [&](size_t chunk)
+		segmented_inputs(const shard_view* views_, uint8_t shard_count, size_t required_size) : views(views_),
+		                                                                                        first_start(shard_count + 1)
 		{
-			for(int output_shard = 0; output_shard < output_count; ++output_shard)
+			for(uint8_t shard = 0; shard < shard_count; ++shard)
 			{
+				first_start[shard] = segment_starts.size();
+				size_t position = 0;
+				for(size_t i = 0; i < views[shard].segment_count; ++i)
 				{
-					int input_shard = 0;
-					do_multiply    (matrix_rows[output_shard][input_shard], inputs[input_shard], outputs[output_shard], offset + (chunk * chunk_size), chunk_size);
+					segment_starts.push_back(position);
+					position += views[shard].segments[i].length;
 				}
-				for(int input_shard = 1; input_shard < input_count; ++input_shard)
+				if(position < required_size)
 				{
-					do_multiply_xor(matrix_rows[output_shard][input_shard], inputs[input_shard], outputs[output_shard], offset + (chunk * chunk_size), chunk_size);
+					throw std::out_of_range("shard segments too short");
 				}
 			}
-		});
-		if(chunks * chunk_size < byte_count)
+			first_start[shard_count] = segment_starts.size();
+		}
+
+		const shard_view* views;
+		std::vector<size_t> segment_starts;
+		std::vector<size_t> first_start;
+	};
+
+	// calls fun(piece, piece_start, piece_length) for each contiguous piece of the input shard's bytes [start, start + length).
+	template <typename F>
+	static void __forceinline for_each_piece(const uint8_t* const* inputs, uint8_t shard, size_t start, size_t length, F&& fun)
+	{
+		fun(inputs[shard] + start, start, length);
+	}
+
+	template <typename F>
+	static void for_each_piece(const segmented_inputs& inputs, uint8_t shard, size_t start, size_t length, F&& fun)
+	{
+		const size_t* const first = inputs.segment_starts.data() + inputs.first_start[shard];
+		const size_t* const last  = inputs.segment_starts.data() + inputs.first_start[shard + 1];
+		size_t i = static_cast<size_t>(std::upper_bound(first, last, start) - first) - 1;
+		while(length != 0)
 		{
-			for(int output_shard = 0; output_shard < output_count; ++output_shard)
+			const segment& s = inputs.views[shard].segments[i];
+			const size_t within       = start - first[i];
+			const size_t piece_length = std::min(length, s.length - within);
+			if(piece_length != 0)
 			{
+				fun(s.data + within, start, piece_length);
+			}
+			start  += piece_length;
+			length -= piece_length;
+			++i;
+		}
+	}
+
+	// computes outputs [first_output, last_output) over one chunk of the byte range.
+	template <typename Inputs>
+	void code_chunk(const chunk_plan& plan, const uint8_t* __restrict* __restrict matrix_rows, const Inputs& inputs, uint8_t input_count, uint8_t* __restrict* __restrict outputs, size_t first_output, size_t last_output, size_t offset, size_t byte_count, size_t chunk) const
+	{
+		const size_t start  = offset + (chunk * plan.chunk_size);
+		const size_t length = std::min(plan.chunk_size, byte_count - (chunk * plan.chunk_size));
+		for(int first_input = 0; first_input < input_count; first_input += plan.input_group_size)
+		{
+			const int last_input = std::min(first_input + plan.input_group_size, static_cast<int>(input_count));
+			for(size_t output_shard = first_output; output_shard != last_output; ++output_shard)
+			{
+				uint8_t* const output = outputs[output_shard];
+				int input_shard = first_input;
+				if(input_shard == 0)
 				{
-					int input_shard = 0;
-					do_multiply    (matrix_rows[output_shard][input_shard], inputs[input_shard], outputs[output_shard], offset + (chunks * chunk_size), byte_count - (chunks * chunk_size));
+					const uint8_t matrix_value = matrix_rows[output_shard][input_shard];
+					for_each_piece(inputs, static_cast<uint8_t>(input_shard), start, length, [&](const uint8_t* piece, size_t piece_start, size_t piece_length)
+					{
+						do_multiply    (matrix_value, piece, output + piece_start, 0, piece_length);
+					});
+					++input_shard;
 				}
-				for(int input_shard = 1; input_shard < input_count; ++input_shard)
+				for(; input_shard < last_input; ++input_shard)
 				{
-					do_multiply_xor(matrix_rows[output_shard][input_shard], inputs[input_shard], outputs[output_shard], offset + (chunks * chunk_size), byte_count - (chunks * chunk_size));
+					const uint8_t matrix_value = matrix_rows[output_shard][input_shard];
+					for_each_piece(inputs, static_cast<uint8_t>(input_shard), start, length, [&](const uint8_t* piece, size_t piece_start, size_t piece_length)
+					{
+						do_multiply_xor(matrix_value, piece, output + piece_start, 0, piece_length);
+					});
 				}
 			}
 		}
 	}
 
-	bool check_some_shards(const uint8_t* __restrict* __restrict matrix_rows, const uint8_t* __restrict* __restrict datas, uint8_t data_count, const uint8_t* __restrict* __restrict parities, uint8_t parity_count, size_t offset, size_t byte_count) const
+	bool runs_serially(execution_policy policy, uint8_t input_count, uint8_t output_count, size_t byte_count) const
 	{
-		static constexpr size_t chunk_size = 4096;
-		static const size_t chunks = byte_count / chunk_size;
-		std::unique_ptr<unsigned char[]> buffer(new unsigned char[(offset * parity_count) + (parity_count * byte_count)]);
-	
-		tbb::combinable<bool> ok;
-		tbb::parallel_for(static_cast<size_t>(0), chunks, [&](size_t chunk)
+		switch(policy)
 		{
-			ok.local() = true;
-			for(int output_shard = 0; output_shard < parity_count; ++output_shard)
+		case execution_policy::serial:
+			return true;
+		case execution_policy::parallel:
+			return false;
+		default:
+			return (static_cast<size_t>(input_count) + static_cast<size_t>(output_count)) * byte_count < serial_threshold;
+		}
+	}
+
+	template <typename Inputs>
+	void code_some_shards(const uint8_t* __restrict* __restrict matrix_rows, const Inputs& inputs, uint8_t input_count, uint8_t* __restrict* __restrict outputs, uint8_t output_count, size_t offset, size_t byte_count, execution_policy policy) const
+	{
+		const chunk_plan plan = plan_chunks(input_count, output_count, byte_count);
+		if(runs_serially(policy, input_count, output_count, byte_count))
+		{
+			for(size_t chunk = 0; chunk < plan.chunk_count; ++chunk)
 			{
+				code_chunk(plan, matrix_rows, inputs, input_count, outputs, 0, output_count, offset, byte_count, chunk);
+			}
+			return;
+		}
+		arena_parallel_for(plan.work_range(output_count), [&](const tbb::blocked_range2d<size_t>& range)
+		{
+			for(size_t chunk = range.cols().begin(); chunk != range.cols().end(); ++chunk)
+			{
+				code_chunk(plan, matrix_rows, inputs, input_count, outputs, range.rows().begin(), range.rows().end(), offset, byte_count, chunk);
+			}
+		});
+	}
+
+	// computes each output byte in registers and compares it against the stored value, so verification needs no scratch buffer.
+	bool do_multiply_compare(const uint8_t* __restrict matrix_row, const uint8_t* __restrict* __restrict inputs, uint8_t input_count, const uint8_t* __restrict expected, size_t offset, size_t byte_count) const
+	{
+		// align on expected, leave inputs unaligned. Rationale: there's one expected vector but input_count inputs, and no guarantee they share an alignment.
+		size_t head = std::min((alignment - (reinterpret_cast<size_t>(&expected[offset]) & (alignment - 1))) % alignment, byte_count);
+		size_t body = (byte_count - head) & (~(alignment - 1));
+		size_t tail = byte_count - body - head;
+
+		uint8_t difference = 0;
+		auto compare_bytes = [&](size_t start, size_t end)
+		{
+			for(size_t i = start; i < end; ++i)
+			{
+				uint8_t value = expected[i];
+				for(uint8_t input_shard = 0; input_shard < input_count; ++input_shard)
 				{
-					int input_shard = 0;
-					do_multiply    (matrix_rows[output_shard][input_shard], datas[input_shard], buffer.get(), offset + (chunk * chunk_size), chunk_size);
-				}
-				for(int input_shard = 1; input_shard < data_count; ++input_shard)
-				{
-					do_multiply_xor(matrix_rows[output_shard][input_shard], datas[input_shard], buffer.get(), offset + (chunk * chunk_size), chunk_size);
+					value ^= galois.MULTIPLICATION_TABLE[matrix_row[input_shard]][inputs[input_shard][i]];
 				}
-				if(0 != std::memcmp(buffer.get() + offset + (chunk * chunk_size), parities[output_shard] + offset + (chunk * chunk_size), chunk_size))
+				difference |= value;
+			}
+		};
+
+		compare_bytes(offset, offset + head);
+		const __m128i mask = _mm_set1_epi8(0x0f);
+		__m128i difference_vector = _mm_setzero_si128();
+		for(size_t i = offset + head; i < offset + head + body; i += alignment)
+		{
+			__m128i accumulators[alignment / stepsize];
+			for(size_t v = 0; v < alignment / stepsize; ++v)
+			{
+				accumulators[v] = _mm_load_si128(reinterpret_cast<const __m128i*>(&expected[i + (v * stepsize)]));
+			}
+			for(uint8_t input_shard = 0; input_shard < input_count; ++input_shard)
+			{
+				const __m128i low_table  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(galois.MULTIPLICATION_TABLE_LOW [matrix_row[input_shard]].data()));
+				const __m128i high_table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(galois.MULTIPLICATION_TABLE_HIGH[matrix_row[input_shard]].data()));
+				const __m128i* __restrict input_ptr = reinterpret_cast<const __m128i*>(&inputs[input_shard][i]);
+				for(size_t v = 0; v < alignment / stepsize; ++v)
 				{
-					ok.local() = false;
-					break;
+					__m128i input        = _mm_loadu_si128(input_ptr + v);
+					__m128i low_indices  = _mm_and_si128(input, mask);
+					__m128i high_indices = _mm_srli_epi8(input, 4);
+					__m128i low_parts    = _mm_shuffle_epi8(low_table, low_indices);
+					__m128i high_parts   = _mm_shuffle_epi8(high_table, high_indices);
+					accumulators[v]      = _mm_xor_si128(accumulators[v], _mm_xor_si128(low_parts, high_parts));
 				}
 			}
-		});
-		bool all_ok = true;
-		ok.combine_each([&](bool val)
+			for(size_t v = 0; v < alignment / stepsize; ++v)
+			{
+				difference_vector = _mm_or_si128(difference_vector, accumulators[v]);
+			}
+		}
+		compare_bytes(offset + head + body, offset + head + body + tail);
+
+		return difference == 0 && _mm_movemask_epi8(_mm_cmpeq_epi8(difference_vector, _mm_setzero_si128())) == 0xffff;
+	}
+
+	// the first mismatching chunk cancels the rest of the verification. If the caller supplies a context, cancelling it abandons the
+	// verification too, in which case the result is false even though no mismatch may have been found.
+	bool check_some_shards(const uint8_t* __restrict* __restrict matrix_rows, const uint8_t* __restrict* __restrict datas, uint8_t data_count, const uint8_t* __restrict* __restrict parities, uint8_t parity_count, size_t offset, size_t byte_count, tbb::task_group_context* cancellation, execution_policy policy) const
+	{
+		if(cancellation && cancellation->is_group_execution_cancelled())
 		{
-			all_ok = all_ok && val;
-		});
-		if(all_ok && (chunks * chunk_size) < byte_count)
+			return false;
+		}
+
+		const chunk_plan plan = plan_chunks(data_count, parity_count, byte_count);
+		if(runs_serially(policy, data_count, parity_count, byte_count))
 		{
-			for(int output_shard = 0; output_shard < parity_count; ++output_shard)
+			for(size_t chunk = 0; chunk < plan.chunk_count; ++chunk)
 			{
+				if(cancellation && cancellation->is_group_execution_cancelled())
+				{
+					return false;
+				}
+				const size_t start  = offset + (chunk * plan.chunk_size);
+				const size_t length = std::min(plan.chunk_size, byte_count - (chunk * plan.chunk_size));
+				for(uint8_t output_shard = 0; output_shard < parity_count; ++output_shard)
 				{
-					int input_shard = 0;
-					do_multiply    (matrix_rows[output_shard][input_shard], datas[input_shard], buffer.get(), offset + (chunks * chunk_size), byte_count - (chunks * chunk_size));
+					if(!do_multiply_compare(matrix_rows[output_shard], datas, data_count, parities[output_shard], start, length))
+					{
+						return false;
+					}
 				}
-				for(int input_shard = 1; input_shard < data_count; ++input_shard)
+			}
+			return true;
+		}
+
+		tbb::task_group_context context;
+		arena_parallel_for(plan.work_range(parity_count), [&](const tbb::blocked_range2d<size_t>& range)
+		{
+			for(size_t chunk = range.cols().begin(); chunk != range.cols().end(); ++chunk)
+			{
+				if(cancellation && cancellation->is_group_execution_cancelled())
 				{
-					do_multiply_xor(matrix_rows[output_shard][input_shard], datas[input_shard], buffer.get(), offset + (chunks * chunk_size), byte_count - (chunks * chunk_size));
+					context.cancel_group_execution();
+					return;
 				}
-				if(0 != std::memcmp(buffer.get() + offset + (chunks * chunk_size), parities[output_shard] + offset + (chunks * chunk_size), byte_count - (chunks * chunk_size)))
+				const size_t start  = offset + (chunk * plan.chunk_size);
+				const size_t length = std::min(plan.chunk_size, byte_count - (chunk * plan.chunk_size));
+				for(size_t output_shard = range.rows().begin(); output_shard != range.rows().end(); ++output_shard)
 				{
-					return false;
+					if(!do_multiply_compare(matrix_rows[output_shard], datas, data_count, parities[output_shard], start, length))
+					{
+						context.cancel_group_execution();
+						return;
+					}
 				}
 			}
-		}
-		return all_ok;
+		}, context);
+		return !context.is_group_execution_cancelled();
 	}
 
 	static matrix build_matrix(uint8_t data_shards, uint8_t total_shards)
@@ -430,4 +1417,12 @@ private:
 	matrix m;
 
 	const uint8_t* __restrict* __restrict parity_rows;
+
+	size_t cache_budget;
+	size_t serial_threshold;
+
+	std::unique_ptr<tbb::task_arena> owned_arena;
+	tbb::task_arena* arena;
+	// the number of threads parallel work is planned for.
+	size_t thread_count;
 };
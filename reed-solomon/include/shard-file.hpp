@@ -0,0 +1,493 @@
+// self-describing shard files. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <cstddef>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// a shard file is laid out as:
+//   header, zero-filled to one block, so that the shard data that follows is block-aligned
+//   shard data, stripe_count * stripe_shard_size bytes: this shard of every stripe, one after another
+//   checksum table, one CRC-32C per block of shard data
+//   footer
+// Every field is stored little-endian, as on x86.
+
+struct shard_file_header
+{
+	static constexpr uint32_t MAGIC   = 0x48535352; // "RSSH"
+	static constexpr uint16_t VERSION = 1;
+
+	// how the parity was computed, so that a reader can tell whether it knows how to decode it.
+	enum codec_id : uint16_t
+	{
+		vandermonde_reed_solomon = 1, // reed_solomon, with build_matrix's systematic Vandermonde matrix
+	};
+
+	uint32_t magic;
+	uint16_t version;
+	uint16_t codec;
+	uint8_t  data_shard_count;
+	uint8_t  parity_shard_count;
+	uint8_t  shard_index;
+	uint8_t  reserved0;
+	uint32_t block_size;
+	uint64_t stripe_shard_size;
+	uint64_t stripe_count;
+	uint64_t object_size;
+	uint32_t reserved1;
+	// CRC-32C of every field before it.
+	uint32_t checksum;
+
+	uint64_t block_count() const
+	{
+		return stripe_count * (stripe_shard_size / block_size);
+	}
+
+	uint64_t data_offset() const
+	{
+		return block_size;
+	}
+
+	uint64_t table_offset() const
+	{
+		return data_offset() + (stripe_count * stripe_shard_size);
+	}
+
+	uint64_t footer_offset() const
+	{
+		return table_offset() + (block_count() * sizeof(uint32_t));
+	}
+
+	void seal()
+	{
+		checksum = crc32c::compute(0, reinterpret_cast<const uint8_t*>(this), offsetof(shard_file_header, checksum));
+	}
+
+	bool is_valid() const
+	{
+		return magic == MAGIC
+		    && version == VERSION
+		    && codec == vandermonde_reed_solomon
+		    && checksum == crc32c::compute(0, reinterpret_cast<const uint8_t*>(this), offsetof(shard_file_header, checksum))
+		    && data_shard_count != 0
+		    && static_cast<size_t>(data_shard_count) + static_cast<size_t>(parity_shard_count) <= 255
+		    && shard_index < data_shard_count + parity_shard_count
+		    && block_size >= sizeof(shard_file_header)
+		    && stripe_shard_size != 0
+		    && (stripe_shard_size % block_size) == 0;
+	}
+
+	// whether two headers describe shards of the same object.
+	bool same_object(const shard_file_header& rhs) const
+	{
+		return codec              == rhs.codec
+		    && data_shard_count   == rhs.data_shard_count
+		    && parity_shard_count == rhs.parity_shard_count
+		    && block_size         == rhs.block_size
+		    && stripe_shard_size  == rhs.stripe_shard_size
+		    && stripe_count       == rhs.stripe_count
+		    && object_size        == rhs.object_size;
+	}
+};
+
+static_assert(sizeof(shard_file_header) == 48, "shard_file_header must have no padding");
+
+struct shard_file_footer
+{
+	static constexpr uint32_t MAGIC = 0x46535352; // "RSSF"
+
+	uint32_t magic;
+	// CRC-32C of all of the shard data.
+	uint32_t shard_checksum;
+	uint64_t block_count;
+	// CRC-32C of the checksum table.
+	uint32_t table_checksum;
+	// CRC-32C of every field before it.
+	uint32_t checksum;
+
+	void seal()
+	{
+		checksum = crc32c::compute(0, reinterpret_cast<const uint8_t*>(this), offsetof(shard_file_footer, checksum));
+	}
+
+	bool is_valid() const
+	{
+		return magic == MAGIC
+		    && checksum == crc32c::compute(0, reinterpret_cast<const uint8_t*>(this), offsetof(shard_file_footer, checksum));
+	}
+};
+
+static_assert(sizeof(shard_file_footer) == 24, "shard_file_footer must have no padding");
+
+// encodes an object stripe by stripe into one shard file per shard. Checksums are computed as each stripe is encoded, and the
+// headers are rewritten by finish() once the object's size is known, so the object can be streamed through.
+struct shard_file_writer
+{
+	static constexpr size_t default_stripe_shard_size = 1024 * 1024;
+
+	// stripe_shard_size is rounded up to a whole number of blocks.
+	shard_file_writer(const encoder& e_, const std::vector<std::string>& paths, size_t stripe_shard_size_ = default_stripe_shard_size, size_t block_size_ = reed_solomon::default_checksum_block_size) : e(e_),
+	                                                                                                                                                                                                   block_size(block_size_),
+	                                                                                                                                                                                                   stripe_shard_size(whole_blocks(stripe_shard_size_, block_size_)),
+	                                                                                                                                                                                                   stripe_shift(crc32c::shift_for(stripe_shard_size)),
+	                                                                                                                                                                                                   stripe_count(0),
+	                                                                                                                                                                                                   object_size(0),
+	                                                                                                                                                                                                   finished(false),
+	                                                                                                                                                                                                   files(paths.size()),
+	                                                                                                                                                                                                   shard_checksums(paths.size(), 0),
+	                                                                                                                                                                                                   block_checksums(paths.size())
+	{
+		if(paths.size() != e.get_shard_count())
+		{
+			throw std::invalid_argument("one path is needed for each shard");
+		}
+		const std::vector<char> blank_header(block_size, 0);
+		for(size_t i = 0; i < paths.size(); ++i)
+		{
+			files[i].open(paths[i], std::ofstream::binary | std::ofstream::trunc);
+			if(!files[i].write(blank_header.data(), blank_header.size()))
+			{
+				throw std::runtime_error("couldn't create shard file");
+			}
+		}
+	}
+
+	size_t get_stripe_shard_size() const
+	{
+		return stripe_shard_size;
+	}
+
+	// a buffer for write_stripe.
+	encoder::buffer allocate_stripe() const
+	{
+		return e.allocate_buffers_from_shard_size(stripe_shard_size);
+	}
+
+	// encodes a stripe whose data shards hold the next object_bytes bytes of the object, zero-filled after them, and appends
+	// each of its shards to its file.
+	void write_stripe(encoder::buffer& b, size_t object_bytes)
+	{
+		if(finished)
+		{
+			throw std::logic_error("shard files already finished");
+		}
+		if(b.shard_size - b.padding_size != stripe_shard_size || object_bytes > stripe_shard_size * e.get_data_shard_count())
+		{
+			throw std::invalid_argument("not a stripe of this writer's size");
+		}
+		const size_t blocks_per_stripe = stripe_shard_size / block_size;
+		std::vector<uint32_t> stripe_checksums(b.shard_count);
+		std::vector<uint32_t> stripe_blocks(b.shard_count * blocks_per_stripe);
+		e.encode_with_checksums(b, stripe_checksums.data(), stripe_blocks.data(), block_size);
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			if(!files[i].write(reinterpret_cast<const char*>(b.shards[i] + b.padding_size), stripe_shard_size))
+			{
+				throw std::runtime_error("couldn't write shard file");
+			}
+			block_checksums[i].insert(block_checksums[i].end(), stripe_blocks.begin() + (i * blocks_per_stripe), stripe_blocks.begin() + ((i + 1) * blocks_per_stripe));
+			shard_checksums[i] = crc32c::combine(shard_checksums[i], stripe_checksums[i], stripe_shift);
+		}
+		++stripe_count;
+		object_size += object_bytes;
+	}
+
+	// reads in until it ends, writing a stripe at a time. Returns the number of bytes read.
+	uint64_t write(std::istream& in)
+	{
+		encoder::buffer b = allocate_stripe();
+		uint64_t bytes_read = 0;
+		for(;;)
+		{
+			size_t stripe_bytes = 0;
+			for(size_t i = 0; i < e.get_data_shard_count(); ++i)
+			{
+				in.read(reinterpret_cast<char*>(b.shards[i]), stripe_shard_size);
+				const size_t shard_bytes = static_cast<size_t>(in.gcount());
+				std::memset(b.shards[i] + shard_bytes, 0, stripe_shard_size - shard_bytes);
+				stripe_bytes += shard_bytes;
+			}
+			if(stripe_bytes == 0)
+			{
+				return bytes_read;
+			}
+			write_stripe(b, stripe_bytes);
+			bytes_read += stripe_bytes;
+		}
+	}
+
+	// appends each file's checksum table and footer, and fills in its header. The files are incomplete until this is called.
+	void finish()
+	{
+		if(finished)
+		{
+			return;
+		}
+		for(size_t i = 0; i < files.size(); ++i)
+		{
+			shard_file_footer footer = {};
+			footer.magic          = shard_file_footer::MAGIC;
+			footer.shard_checksum = shard_checksums[i];
+			footer.block_count    = block_checksums[i].size();
+			footer.table_checksum = crc32c::compute(0, reinterpret_cast<const uint8_t*>(block_checksums[i].data()), block_checksums[i].size() * sizeof(uint32_t));
+			footer.seal();
+
+			shard_file_header header = {};
+			header.magic              = shard_file_header::MAGIC;
+			header.version            = shard_file_header::VERSION;
+			header.codec              = shard_file_header::vandermonde_reed_solomon;
+			header.data_shard_count   = e.get_data_shard_count();
+			header.parity_shard_count = e.get_parity_shard_count();
+			header.shard_index        = static_cast<uint8_t>(i);
+			header.block_size         = static_cast<uint32_t>(block_size);
+			header.stripe_shard_size  = stripe_shard_size;
+			header.stripe_count       = stripe_count;
+			header.object_size        = object_size;
+			header.seal();
+
+			files[i].write(reinterpret_cast<const char*>(block_checksums[i].data()), block_checksums[i].size() * sizeof(uint32_t));
+			files[i].write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+			files[i].seekp(0);
+			files[i].write(reinterpret_cast<const char*>(&header), sizeof(header));
+			files[i].flush();
+			if(!files[i])
+			{
+				throw std::runtime_error("couldn't finish shard file");
+			}
+		}
+		finished = true;
+	}
+
+private:
+	static size_t whole_blocks(size_t size, size_t block)
+	{
+		if(block < sizeof(shard_file_header) || block > std::numeric_limits<uint32_t>::max())
+		{
+			throw std::invalid_argument("bad block size");
+		}
+		return std::max<size_t>((size + block - 1) / block, 1) * block;
+	}
+
+	const encoder& e;
+	const size_t block_size;
+	const size_t stripe_shard_size;
+	const crc32c::shift_t stripe_shift;
+	uint64_t stripe_count;
+	uint64_t object_size;
+	bool finished;
+	std::vector<std::ofstream> files;
+	std::vector<uint32_t> shard_checksums;
+	std::vector<std::vector<uint32_t>> block_checksums;
+};
+
+// reads back the shard files of one object, whatever they're called and in whatever order they're given; each file's header
+// says which shard it holds. Files that can't be opened, whose header or checksum table is damaged, or that belong to some
+// other object are treated as missing.
+struct shard_file_reader
+{
+	// one bitmap per shard, one bit per block, set for each block that's missing or doesn't match its checksum.
+	typedef reed_solomon::damage_map damage_map;
+
+	// throws if none of the files is a valid shard file.
+	explicit shard_file_reader(const std::vector<std::string>& paths)
+	{
+		std::vector<std::ifstream> candidates;
+		std::vector<shard_file_header> candidate_headers;
+		for(const std::string& path : paths)
+		{
+			std::ifstream fin(path, std::ifstream::binary);
+			shard_file_header candidate = {};
+			if(fin.read(reinterpret_cast<char*>(&candidate), sizeof(candidate)) && candidate.is_valid())
+			{
+				candidates.push_back(std::move(fin));
+				candidate_headers.push_back(candidate);
+			}
+		}
+		if(candidates.empty())
+		{
+			throw std::runtime_error("no valid shard files");
+		}
+		// the first valid header decides which object this is.
+		header = candidate_headers[0];
+		e.reset(new encoder{ header.data_shard_count, header.parity_shard_count });
+		files.resize(e->get_shard_count());
+		tables.resize(e->get_shard_count());
+		for(size_t i = 0; i < candidates.size(); ++i)
+		{
+			const uint8_t shard = candidate_headers[i].shard_index;
+			if(candidate_headers[i].same_object(header) && !files[shard].is_open() && load_table(candidates[i], tables[shard]))
+			{
+				files[shard] = std::move(candidates[i]);
+			}
+		}
+	}
+
+	shard_file_reader(const shard_file_reader&) = delete;
+	shard_file_reader& operator=(const shard_file_reader&) = delete;
+
+	// the header shared by every shard, apart from shard_index.
+	const shard_file_header& get_header() const
+	{
+		return header;
+	}
+
+	encoder& get_encoder()
+	{
+		return *e;
+	}
+
+	bool is_present(uint8_t shard) const
+	{
+		return files.at(shard).is_open();
+	}
+
+	// reads every present shard end to end, each file on its own thread, comparing every block with its checksum. Nothing is
+	// decoded, so this runs at the speed of the disks.
+	damage_map scan()
+	{
+		const uint64_t block_count = header.block_count();
+		damage_map damage(files.size(), std::vector<bool>(static_cast<size_t>(block_count), true));
+		tbb::parallel_for(size_t(0), files.size(), [&](size_t shard)
+		{
+			if(!files[shard].is_open())
+			{
+				return;
+			}
+			std::vector<uint8_t> stripe(static_cast<size_t>(header.stripe_shard_size));
+			const uint64_t blocks_per_stripe = header.stripe_shard_size / header.block_size;
+			for(uint64_t s = 0; s < header.stripe_count; ++s)
+			{
+				if(!read_shard(static_cast<uint8_t>(shard), s, stripe.data()))
+				{
+					break;
+				}
+				for(uint64_t block = 0; block < blocks_per_stripe; ++block)
+				{
+					const uint64_t index = (s * blocks_per_stripe) + block;
+					damage[shard][static_cast<size_t>(index)] = crc32c::compute(0, stripe.data() + (block * header.block_size), header.block_size) != tables[shard][static_cast<size_t>(index)];
+				}
+			}
+		});
+		return damage;
+	}
+
+	// the stripes with any damaged block.
+	std::vector<uint64_t> damaged_stripes(const damage_map& damage) const
+	{
+		const uint64_t blocks_per_stripe = header.stripe_shard_size / header.block_size;
+		std::vector<uint64_t> stripes;
+		for(uint64_t s = 0; s < header.stripe_count; ++s)
+		{
+			bool damaged = false;
+			for(size_t shard = 0; shard < damage.size() && !damaged; ++shard)
+			{
+				for(uint64_t block = s * blocks_per_stripe; block < (s + 1) * blocks_per_stripe && !damaged; ++block)
+				{
+					damaged = damage[shard][static_cast<size_t>(block)];
+				}
+			}
+			if(damaged)
+			{
+				stripes.push_back(s);
+			}
+		}
+		return stripes;
+	}
+
+	// writes the object to out, a stripe at a time. Each data shard is checked against its checksums as it's read; only
+	// stripes where a block doesn't match have their parity read, and only the blocks that don't match are decoded. Returns
+	// false, having written the stripes before it, at the first stripe with a block damaged in more shards than there is parity.
+	bool read_object(std::ostream& out)
+	{
+		encoder::buffer b = e->allocate_buffers_from_shard_size(static_cast<size_t>(header.stripe_shard_size));
+		damage_map stripe_damage(b.shard_count, std::vector<bool>(static_cast<size_t>(header.stripe_shard_size / header.block_size)));
+		uint64_t bytes_remaining = header.object_size;
+		for(uint64_t s = 0; s < header.stripe_count && bytes_remaining != 0; ++s)
+		{
+			bool intact = true;
+			for(uint8_t shard = 0; shard < e->get_data_shard_count(); ++shard)
+			{
+				intact = read_and_check(shard, s, b.shards[shard], stripe_damage[shard]) && intact;
+			}
+			if(!intact)
+			{
+				for(uint8_t shard = e->get_data_shard_count(); shard < b.shard_count; ++shard)
+				{
+					read_and_check(shard, s, b.shards[shard], stripe_damage[shard]);
+				}
+				if(!e->repair_blocks(b, stripe_damage, header.block_size))
+				{
+					return false;
+				}
+			}
+			for(size_t shard = 0; shard < e->get_data_shard_count() && bytes_remaining != 0; ++shard)
+			{
+				const size_t bytes = static_cast<size_t>(std::min<uint64_t>(header.stripe_shard_size, bytes_remaining));
+				if(!out.write(reinterpret_cast<const char*>(b.shards[shard]), bytes))
+				{
+					throw std::runtime_error("couldn't write output");
+				}
+				bytes_remaining -= bytes;
+			}
+		}
+		return bytes_remaining == 0;
+	}
+
+private:
+	bool load_table(std::ifstream& fin, std::vector<uint32_t>& table)
+	{
+		shard_file_footer footer = {};
+		fin.seekg(header.footer_offset());
+		if(!fin.read(reinterpret_cast<char*>(&footer), sizeof(footer)) || !footer.is_valid() || footer.block_count != header.block_count())
+		{
+			return false;
+		}
+		table.resize(static_cast<size_t>(footer.block_count));
+		fin.seekg(header.table_offset());
+		return fin.read(reinterpret_cast<char*>(table.data()), table.size() * sizeof(uint32_t))
+		    && crc32c::compute(0, reinterpret_cast<const uint8_t*>(table.data()), table.size() * sizeof(uint32_t)) == footer.table_checksum;
+	}
+
+	bool read_shard(uint8_t shard, uint64_t stripe, uint8_t* destination)
+	{
+		std::ifstream& fin = files[shard];
+		if(!fin.is_open())
+		{
+			return false;
+		}
+		fin.clear();
+		fin.seekg(header.data_offset() + (stripe * header.stripe_shard_size));
+		return static_cast<bool>(fin.read(reinterpret_cast<char*>(destination), static_cast<std::streamsize>(header.stripe_shard_size)));
+	}
+
+	// reads one shard of a stripe, marking each block that doesn't match its checksum, or every block if the shard can't be
+	// read. Returns whether every block matched.
+	bool read_and_check(uint8_t shard, uint64_t stripe, uint8_t* destination, std::vector<bool>& damaged)
+	{
+		if(!read_shard(shard, stripe, destination))
+		{
+			std::fill(damaged.begin(), damaged.end(), true);
+			return false;
+		}
+		const uint64_t blocks_per_stripe = header.stripe_shard_size / header.block_size;
+		bool intact = true;
+		for(uint64_t block = 0; block < blocks_per_stripe; ++block)
+		{
+			damaged[static_cast<size_t>(block)] = crc32c::compute(0, destination + (block * header.block_size), header.block_size) != tables[shard][static_cast<size_t>((stripe * blocks_per_stripe) + block)];
+			intact = intact && !damaged[static_cast<size_t>(block)];
+		}
+		return intact;
+	}
+
+	shard_file_header header;
+	std::unique_ptr<encoder> e;
+	std::vector<std::ifstream> files;
+	std::vector<std::vector<uint32_t>> tables;
+};
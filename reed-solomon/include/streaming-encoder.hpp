@@ -0,0 +1,59 @@
+// incremental stripe encoding. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+#include "encoder.hpp"
+
+#include <vector>
+
+// builds one stripe's parity as its data arrives, rather than once the whole stripe has been buffered. Each data shard is
+// appended to in order, in pieces of any size, and the data shards may be appended to in any interleaving. Each piece is
+// folded into the parity as it comes in, so the caller needn't keep it. Data shards that end short of shard_size are treated
+// as zero-padded. One stripe at a time; calls mustn't overlap.
+struct streaming_encoder
+{
+	streaming_encoder(const encoder& e_, size_t shard_size_) : e(e_),
+	                                                           parity{ shard_size_ * e_.get_parity_shard_count(), shard_size_, static_cast<size_t>(e_.get_parity_shard_count()), 0 },
+	                                                           lengths(e_.get_data_shard_count(), 0),
+	                                                           finished(false)
+	{
+	}
+
+	size_t get_shard_size() const
+	{
+		return parity.shard_size;
+	}
+
+	// how much of a data shard has been appended so far.
+	size_t get_shard_length(uint8_t data_shard) const
+	{
+		return lengths.at(data_shard);
+	}
+
+	void append(uint8_t data_shard, const uint8_t* data, size_t length)
+	{
+		if(finished)
+		{
+			throw std::logic_error("stripe already finished");
+		}
+		if(data_shard >= lengths.size() || lengths[data_shard] + length > parity.shard_size)
+		{
+			throw std::out_of_range("past the end of the shard");
+		}
+		e.add_to_parity(data_shard, data, lengths[data_shard], length, parity);
+		lengths[data_shard] += length;
+	}
+
+	// the stripe's parity shards. No more data can be appended afterwards.
+	encoder::buffer& finish()
+	{
+		finished = true;
+		return parity;
+	}
+
+private:
+	const encoder& e;
+	encoder::buffer parity;
+	std::vector<size_t> lengths;
+	bool finished;
+};
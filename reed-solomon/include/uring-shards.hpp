@@ -0,0 +1,194 @@
+// io_uring shard I/O. copyright 2015 Peter Bright, Backblaze. See LICENSE.txt for licensing details.
+
+#pragma once
+
+// optional, Linux only, and needs liburing; define REED_SOLOMON_USE_IO_URING and link with -luring to use it.
+#if defined(__linux__) && defined(REED_SOLOMON_USE_IO_URING)
+
+#include "encoder.hpp"
+
+#include <liburing.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <vector>
+
+// reads and writes every shard of a stripe with a single batch of io_uring submissions, so that all of the shard files'
+// devices are kept busy at once. Submission doesn't wait, so the next stripe can be encoded while this one is written.
+struct uring_shard_io
+{
+	static constexpr unsigned default_queue_depth = 128;
+
+	explicit uring_shard_io(unsigned queue_depth_ = default_queue_depth) : queue_depth(queue_depth_),
+	                                                                      in_flight(0)
+	{
+		const int result = ::io_uring_queue_init(queue_depth, &ring, 0);
+		if(result < 0)
+		{
+			throw std::runtime_error("couldn't create io_uring");
+		}
+	}
+
+	~uring_shard_io()
+	{
+		try
+		{
+			wait_all();
+		}
+		catch(...)
+		{
+		}
+		::io_uring_queue_exit(&ring);
+	}
+
+	uring_shard_io(const uring_shard_io&) = delete;
+	uring_shard_io& operator=(const uring_shard_io&) = delete;
+
+	// pins each buffer's memory with the kernel once, rather than for every request. The buffers must stay alive until they're
+	// unregistered or replaced by another registration. Shards of unregistered buffers still work, just without the saving.
+	void register_buffers(const encoder::buffer* buffers, size_t buffer_count)
+	{
+		unregister_buffers();
+		std::vector<iovec> regions;
+		for(size_t i = 0; i < buffer_count; ++i)
+		{
+			regions.push_back(iovec{ buffers[i].data.get(), buffers[i].buffer_size });
+		}
+		if(::io_uring_register_buffers(&ring, regions.data(), static_cast<unsigned>(regions.size())) < 0)
+		{
+			throw std::runtime_error("couldn't register buffers");
+		}
+		registered = std::move(regions);
+	}
+
+	void unregister_buffers()
+	{
+		if(!registered.empty())
+		{
+			wait_all();
+			::io_uring_unregister_buffers(&ring);
+			registered.clear();
+		}
+	}
+
+	// queues a write of shard i of b to files[i] at file_offset, for every shard, and returns without waiting.
+	void submit_write(const encoder::buffer& b, const int* files, uint64_t file_offset)
+	{
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			queue(false, files[i], b.shards[i], b.shard_size, file_offset);
+		}
+		::io_uring_submit(&ring);
+	}
+
+	// queues a read of every present shard of b from files[i] at file_offset, and returns without waiting.
+	void submit_read(encoder::buffer& b, const int* files, const bool* present, uint64_t file_offset)
+	{
+		for(size_t i = 0; i < b.shard_count; ++i)
+		{
+			if(present[i])
+			{
+				queue(true, files[i], b.shards[i], b.shard_size, file_offset);
+			}
+		}
+		::io_uring_submit(&ring);
+	}
+
+	// waits for every queued request. Throws if any of them failed or transferred fewer bytes than asked.
+	void wait_all()
+	{
+		while(in_flight != 0)
+		{
+			reap_one();
+		}
+	}
+
+	size_t get_in_flight() const
+	{
+		return in_flight;
+	}
+
+private:
+	// queues [address, address + length) as requests of at most a gigabyte. A request's length is unsigned and its result an
+	// int, and Linux moves a little under 2 GiB per read or write at most, so a larger request would come back short. A
+	// gigabyte also keeps every piece block-aligned for O_DIRECT.
+	void queue(bool read, int file, uint8_t* address, size_t length, uint64_t file_offset)
+	{
+		const size_t largest_piece = 1024 * 1024 * 1024;
+		while(length != 0)
+		{
+			const size_t piece = std::min(length, largest_piece);
+			queue_piece(read, file, address, piece, file_offset);
+			address     += piece;
+			length      -= piece;
+			file_offset += piece;
+		}
+	}
+
+	void queue_piece(bool read, int file, uint8_t* address, size_t length, uint64_t file_offset)
+	{
+		// the completion queue is twice the submission queue, so capping requests in flight at the queue depth means no completion is ever dropped.
+		if(in_flight == queue_depth)
+		{
+			::io_uring_submit(&ring);
+			reap_one();
+		}
+		io_uring_sqe* sqe = ::io_uring_get_sqe(&ring);
+		if(sqe == nullptr)
+		{
+			::io_uring_submit(&ring);
+			sqe = ::io_uring_get_sqe(&ring);
+		}
+		const int region = find_region(address, length);
+		if(region < 0)
+		{
+			read ? ::io_uring_prep_read (sqe, file, address, static_cast<unsigned>(length), file_offset)
+			     : ::io_uring_prep_write(sqe, file, address, static_cast<unsigned>(length), file_offset);
+		}
+		else
+		{
+			read ? ::io_uring_prep_read_fixed (sqe, file, address, static_cast<unsigned>(length), file_offset, region)
+			     : ::io_uring_prep_write_fixed(sqe, file, address, static_cast<unsigned>(length), file_offset, region);
+		}
+		::io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(length)));
+		++in_flight;
+	}
+
+	void reap_one()
+	{
+		io_uring_cqe* cqe = nullptr;
+		if(::io_uring_wait_cqe(&ring, &cqe) < 0)
+		{
+			throw std::runtime_error("couldn't wait for shard I/O");
+		}
+		const int result = cqe->res;
+		const size_t expected = static_cast<size_t>(reinterpret_cast<uintptr_t>(::io_uring_cqe_get_data(cqe)));
+		::io_uring_cqe_seen(&ring, cqe);
+		--in_flight;
+		if(result < 0 || static_cast<size_t>(result) != expected)
+		{
+			throw std::runtime_error("shard I/O failed");
+		}
+	}
+
+	// the registered buffer holding [address, address + length), or -1.
+	int find_region(const uint8_t* address, size_t length) const
+	{
+		for(size_t i = 0; i < registered.size(); ++i)
+		{
+			const uint8_t* base = static_cast<const uint8_t*>(registered[i].iov_base);
+			if(address >= base && address + length <= base + registered[i].iov_len)
+			{
+				return static_cast<int>(i);
+			}
+		}
+		return -1;
+	}
+
+	io_uring ring;
+	const unsigned queue_depth;
+	size_t in_flight;
+	std::vector<iovec> registered;
+};
+
+#endif
@@ -2,11 +2,16 @@
 
 #include <SDKDDKVer.h>
 
-#include "encoder.hpp"
+#include "file-encoder.hpp"
+#include "mapped-shards.hpp"
+#include "shard-file.hpp"
 
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 int main(int argc, char* argv[])
 {
@@ -75,6 +80,16 @@ int main(int argc, char* argv[])
 		std::cout << "Does clobbering a parity shard verify? " << e.verify(buf) << std::endl;
 		e.repair(buf, present.get());
 		std::cout << "Does reading a repaired parity shard verify? " << e.verify(buf) << std::endl;
+		// silently corrupt a few bytes of a data shard
+		buf.shards[7][buf.padding_size + 100] ^= 0x5a;
+		buf.shards[7][buf.padding_size + 101] ^= 0xa5;
+		std::cout << "Does silently corrupting a data shard verify? " << e.verify(buf) << std::endl;
+		for(const reed_solomon::corrupt_range& range : e.locate_corruption(buf))
+		{
+			std::cout << "Corruption found in shard " << static_cast<unsigned int>(range.shard) << " at offset " << range.offset << ", length " << range.length << std::endl;
+		}
+		e.repair_corruption(buf);
+		std::cout << "Does reading a repaired corrupted shard verify? " << e.verify(buf) << std::endl;
 
 		std::ofstream fout(std::string(filename) + ".recovered", std::ofstream::binary | std::ofstream::trunc);
 		uint64_t bytes_remaining = *reinterpret_cast<const uint64_t*>(buf.shards[0]);
@@ -85,6 +100,98 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	{
+		// rebuild lost shard files in place, without reading the survivors into memory first
+		std::vector<std::string> paths;
+		std::unique_ptr<bool[]> present{ new bool[e.get_shard_count()] };
+		for(size_t i = 0; i < e.get_shard_count(); ++i)
+		{
+			paths.push_back(std::string(filename) + "." + std::to_string(i));
+			present[i] = true;
+		}
+		present[3] = false;
+		present[18] = false;
+		const size_t padding_size = encoder::padding_size_for(sizeof(uint64_t));
+		{
+			mapped_shard_set shards(paths, present.get());
+			e.repair(shards.get_shards(), present.get(), shards.get_shard_size(), padding_size);
+			shards.flush();
+		}
+		std::fill(present.get(), present.get() + e.get_shard_count(), true);
+		mapped_shard_set shards(paths, present.get());
+		std::cout << "Do rebuilt shard files verify? " << e.verify(shards.get_shards(), shards.get_shard_size(), padding_size) << std::endl;
+	}
+
+	{
+		// the same file again, streamed through in fixed-size stripes instead of being read into memory all at once
+		file_encoder fe{ 17, 3 };
+		uint64_t file_size = 0;
+		{
+			std::ifstream fin(filename, std::ifstream::binary);
+			std::vector<std::ofstream> fouts;
+			std::vector<std::ostream*> shards;
+			for(size_t i = 0; i < fe.get_encoder().get_shard_count(); ++i)
+			{
+				fouts.emplace_back(std::string(filename) + ".stream." + std::to_string(i), std::ofstream::binary | std::ofstream::trunc);
+			}
+			for(std::ofstream& fout : fouts)
+			{
+				shards.push_back(&fout);
+			}
+			file_size = fe.encode_file(fin, shards.data());
+		}
+		{
+			std::vector<std::ifstream> fins;
+			std::vector<std::istream*> shards;
+			std::unique_ptr<bool[]> present{ new bool[fe.get_encoder().get_shard_count()] };
+			for(size_t i = 0; i < fe.get_encoder().get_shard_count(); ++i)
+			{
+				fins.emplace_back(std::string(filename) + ".stream." + std::to_string(i), std::ifstream::binary);
+				present[i] = true;
+			}
+			for(std::ifstream& fin : fins)
+			{
+				shards.push_back(&fin);
+			}
+			// lose a data shard and a parity shard
+			present[3] = false;
+			present[18] = false;
+			std::ofstream fout(std::string(filename) + ".stream.recovered", std::ofstream::binary | std::ofstream::trunc);
+			std::cout << "Does a streamed file decode with two shards missing? " << fe.decode_file(shards.data(), present.get(), file_size, fout) << std::endl;
+		}
+	}
+
+	{
+		// self-describing shard files: each knows which shard it is and carries a checksum for every block, so they can be
+		// given in any order, and damage is found without decoding anything
+		std::vector<std::string> paths;
+		for(size_t i = 0; i < e.get_shard_count(); ++i)
+		{
+			paths.push_back(std::string(filename) + ".shard." + std::to_string(i));
+		}
+		{
+			std::ifstream fin(filename, std::ifstream::binary);
+			shard_file_writer writer(e, paths, 64 * 1024);
+			writer.write(fin);
+			writer.finish();
+		}
+		// lose one shard file, and flip a byte in another
+		std::remove(paths[3].c_str());
+		{
+			std::fstream damaged(paths[7], std::fstream::in | std::fstream::out | std::fstream::binary);
+			damaged.seekg(reed_solomon::default_checksum_block_size + 100);
+			const char c = static_cast<char>(damaged.get() ^ 0x5a);
+			damaged.seekp(reed_solomon::default_checksum_block_size + 100);
+			damaged.put(c);
+		}
+		std::reverse(paths.begin(), paths.end());
+		shard_file_reader reader(paths);
+		const shard_file_reader::damage_map damage = reader.scan();
+		std::cout << "Stripes with damaged shard files: " << reader.damaged_stripes(damage).size() << " of " << reader.get_header().stripe_count << std::endl;
+		std::ofstream fout(std::string(filename) + ".shard.recovered", std::ofstream::binary | std::ofstream::trunc);
+		std::cout << "Do damaged shard files decode? " << reader.read_object(fout) << std::endl;
+	}
+
 	return 0;
 }
 